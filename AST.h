@@ -1,16 +1,45 @@
 #ifndef AST_H
 #define AST_H
+#include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Value.h"
 #include <vector>
+#include <set>
 #include <iostream>
 #define AST_OUTPUT
 
 using namespace llvm;
 
+/* Node classes, ASTFile.cc writes a node by its kind. */
+enum ASTKind
+{
+  ast_number_double = 1,
+  ast_number_int = 2,
+  ast_variable = 3,
+  ast_index = 4,
+  ast_field = 5,
+  ast_binary = 6,
+  ast_call = 7,
+  ast_decl = 8,
+  ast_simp = 9,
+  ast_return = 10,
+  ast_block = 11,
+  ast_ifelse = 12,
+  ast_while = 13,
+  ast_parallel_for = 14,
+  ast_prototype = 15,
+  ast_function = 16,
+  ast_struct = 17,
+};
+
+class ASTWriter;
+class ASTMemory;
+
 class ExprAST
 {
 public:
   virtual ~ExprAST() = default;
+  virtual ASTKind getKind() const = 0;
+  virtual void collectCallees(std::set<std::string> &) {}
 #ifdef AST_CODEGEN
   virtual Value *codegen() = 0;
 #endif
@@ -21,10 +50,13 @@ public:
 
 class NumberDoubleExprAST : public ExprAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   double Val;
 
 public:
   NumberDoubleExprAST(double Val) : Val(Val) {}
+  ASTKind getKind() const override { return ast_number_double; }
 #ifdef AST_CODEGEN
   Value *codegen() override;
 #endif
@@ -38,10 +70,13 @@ public:
 
 class NumberIntExprAST : public ExprAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   int Val;
 
 public:
   NumberIntExprAST(int Val) : Val(Val) {}
+  ASTKind getKind() const override { return ast_number_int; }
 #ifdef AST_CODEGEN
   Value *codegen() override;
 #endif
@@ -55,10 +90,13 @@ public:
 
 class VariableExprAST : public ExprAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::string Name;
 
 public:
   VariableExprAST(const std::string &Name) : Name(Name) {}
+  ASTKind getKind() const override { return ast_variable; }
 #ifdef AST_CODEGEN
   Value *codegen() override;
 #endif
@@ -70,8 +108,75 @@ public:
 #endif
 };
 
+class IndexExprAST : public ExprAST
+{
+  friend class ASTWriter;
+  friend class ASTMemory;
+  std::string Name;
+  std::unique_ptr<ExprAST> Index;
+
+public:
+  IndexExprAST(const std::string &Name, std::unique_ptr<ExprAST> Index)
+      : Name(Name), Index(std::move(Index)) {}
+  ASTKind getKind() const override { return ast_index; }
+  void collectCallees(std::set<std::string> &Callees) override
+  {
+    Index->collectCallees(Callees);
+  }
+#ifdef AST_CODEGEN
+  Value *codegen() override;
+#endif
+#ifdef AST_OUTPUT
+  void output() override
+  {
+    std::cout << "(Index: " << Name << " [";
+    Index->output();
+    std::cout << "])";
+  }
+#endif
+};
+
+class FieldExprAST : public ExprAST
+{
+  friend class ASTWriter;
+  friend class ASTMemory;
+  std::string Name;
+  /* Record picked from an array of records, null for a single record. */
+  std::unique_ptr<ExprAST> Index;
+  std::string Field;
+
+public:
+  FieldExprAST(const std::string &Name, std::unique_ptr<ExprAST> Index,
+               const std::string &Field)
+      : Name(Name), Index(std::move(Index)), Field(Field) {}
+  ASTKind getKind() const override { return ast_field; }
+  void collectCallees(std::set<std::string> &Callees) override
+  {
+    if (Index)
+      Index->collectCallees(Callees);
+  }
+#ifdef AST_CODEGEN
+  Value *codegen() override;
+#endif
+#ifdef AST_OUTPUT
+  void output() override
+  {
+    std::cout << "(Field: " << Name;
+    if (Index)
+    {
+      std::cout << " [";
+      Index->output();
+      std::cout << "]";
+    }
+    std::cout << " ." << Field << ")";
+  }
+#endif
+};
+
 class BinaryExprAST : public ExprAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   const char Op;
   std::unique_ptr<ExprAST> LHS, RHS;
 
@@ -80,8 +185,28 @@ public:
                 std::unique_ptr<ExprAST> LHS,
                 std::unique_ptr<ExprAST> RHS)
       : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  /* Operator chains are left-deep, unlink the left operands one by one
+     instead of recursing down them. */
+  ~BinaryExprAST() override
+  {
+    while (LHS && LHS->getKind() == ast_binary)
+    {
+      auto Next = std::move(static_cast<BinaryExprAST *>(LHS.get())->LHS);
+      LHS = std::move(Next);
+    }
+  }
+  ASTKind getKind() const override { return ast_binary; }
+  void collectCallees(std::set<std::string> &Callees) override
+  {
+    auto *E = this;
+    for (; E->LHS->getKind() == ast_binary; E = static_cast<BinaryExprAST *>(E->LHS.get()))
+      E->RHS->collectCallees(Callees);
+    E->LHS->collectCallees(Callees);
+    E->RHS->collectCallees(Callees);
+  }
 #ifdef AST_CODEGEN
   Value *codegen() override;
+  Value *codegenOp(Value *L, Value *R);
 #endif
 #ifdef AST_OUTPUT
   void output() override
@@ -97,6 +222,8 @@ public:
 
 class CallExprAST : public ExprAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::string Callee;
   std::vector<std::unique_ptr<ExprAST>> Args;
 
@@ -104,9 +231,20 @@ public:
   CallExprAST(const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args)
       : Callee(Callee), Args(std::move(Args)) {}
+  ASTKind getKind() const override { return ast_call; }
+  void collectCallees(std::set<std::string> &Callees) override
+  {
+    Callees.insert(Callee);
+    for (auto &Arg : Args)
+      Arg->collectCallees(Callees);
+  }
 #ifdef AST_CODEGEN
   Value *codegen() override;
+  bool codegenArgs(Function *CalleeF, std::vector<Value *> &ArgsValue);
+  Value *codegenReduction(int Kind);
 #endif
+
+  const std::string &getCallee() const { return Callee; }
 #ifdef AST_OUTPUT
   void output() override
   {
@@ -122,6 +260,27 @@ class StmtAST
 {
 public:
   virtual ~StmtAST() = default;
+  virtual ASTKind getKind() const = 0;
+  /* Calls in the expressions of this statement itself, collectCallees()
+     adds the ones of the statements nested in it. */
+  virtual void collectOwnCallees(std::set<std::string> &) {}
+  /* Statements nested directly in this one, blocks for an if or a loop.
+     Walks over them keep a work list so deep nesting needs no native
+     stack. */
+  virtual void getChildren(std::vector<StmtAST *> &) {}
+  /* Move them out instead, see ~BlockAST(). */
+  virtual void takeChildren(std::vector<std::unique_ptr<StmtAST>> &) {}
+  void collectCallees(std::set<std::string> &Callees)
+  {
+    std::vector<StmtAST *> Work{this};
+    while (!Work.empty())
+    {
+      auto S = Work.back();
+      Work.pop_back();
+      S->collectOwnCallees(Callees);
+      S->getChildren(Work);
+    }
+  }
 #ifdef AST_CODEGEN
   virtual Value *codegen() = 0;
 #endif
@@ -132,12 +291,24 @@ public:
 
 class DeclStmtAST : public StmtAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   int ValType;
   std::vector<std::string> Names;
+  /* Element count of each array, null for scalar variables. */
+  std::vector<std::unique_ptr<ExprAST>> Sizes;
 
 public:
-  DeclStmtAST(int ValType, std::vector<std::string> Names)
-      : ValType(ValType), Names(std::move(Names)) {}
+  DeclStmtAST(int ValType, std::vector<std::string> Names,
+              std::vector<std::unique_ptr<ExprAST>> Sizes)
+      : ValType(ValType), Names(std::move(Names)), Sizes(std::move(Sizes)) {}
+  ASTKind getKind() const override { return ast_decl; }
+  void collectOwnCallees(std::set<std::string> &Callees) override
+  {
+    for (auto &Size : Sizes)
+      if (Size)
+        Size->collectCallees(Callees);
+  }
 #ifdef AST_CODEGEN
   Value *codegen() override;
 #endif
@@ -145,8 +316,16 @@ public:
   void output() override
   {
     std::cout << "Declaration type " << ValType << " ( ";
-    for (auto Name : Names)
-      std::cout << Name << " ";
+    for (size_t i = 0; i < Names.size(); i++)
+    {
+      std::cout << Names[i] << " ";
+      if (Sizes[i])
+      {
+        std::cout << "[";
+        Sizes[i]->output();
+        std::cout << "] ";
+      }
+    }
     std::cout << ");" << std::endl;
   }
 #endif
@@ -154,19 +333,43 @@ public:
 
 class SimpStmtAST : public StmtAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::string Name;
   std::unique_ptr<ExprAST> Expr;
+  /* Element assigned to, null unless Name is an array. */
+  std::unique_ptr<ExprAST> Index;
+  /* Field assigned to, empty unless Name is a record. */
+  std::string Field;
 
 public:
-  SimpStmtAST(const std::string &Name, std::unique_ptr<ExprAST> Expr)
-      : Name(Name), Expr(std::move(Expr)) {}
+  SimpStmtAST(const std::string &Name, std::unique_ptr<ExprAST> Expr,
+              std::unique_ptr<ExprAST> Index = nullptr,
+              const std::string &Field = "")
+      : Name(Name), Expr(std::move(Expr)), Index(std::move(Index)), Field(Field) {}
+  ASTKind getKind() const override { return ast_simp; }
+  void collectOwnCallees(std::set<std::string> &Callees) override
+  {
+    Expr->collectCallees(Callees);
+    if (Index)
+      Index->collectCallees(Callees);
+  }
 #ifdef AST_CODEGEN
   Value *codegen() override;
 #endif
 #ifdef AST_OUTPUT
   void output() override
   {
-    std::cout << "Assignment: " << Name << " = ";
+    std::cout << "Assignment: " << Name;
+    if (Index)
+    {
+      std::cout << "[";
+      Index->output();
+      std::cout << "]";
+    }
+    if (!Field.empty())
+      std::cout << "." << Field;
+    std::cout << " = ";
     Expr->output();
     std::cout << ";" << std::endl;
   }
@@ -175,11 +378,18 @@ public:
 
 class ReturnStmtAST : public StmtAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   const std::unique_ptr<ExprAST> Expr;
 
 public:
   ReturnStmtAST(std::unique_ptr<ExprAST> Expr)
       : Expr(std::move(Expr)) {}
+  ASTKind getKind() const override { return ast_return; }
+  void collectOwnCallees(std::set<std::string> &Callees) override
+  {
+    Expr->collectCallees(Callees);
+  }
 #ifdef AST_CODEGEN
   Value *codegen() override;
 #endif
@@ -195,14 +405,45 @@ public:
 
 class BlockAST : public StmtAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::vector<std::unique_ptr<StmtAST>> Stmts;
 
 public:
   BlockAST(std::vector<std::unique_ptr<StmtAST>> Stmts)
       : Stmts(std::move(Stmts)) {}
+  /* The statements nested in this block die one at a time off a work
+     list, none of them has children left by then. */
+  ~BlockAST() override
+  {
+    std::vector<std::unique_ptr<StmtAST>> Work;
+    takeChildren(Work);
+    while (!Work.empty())
+    {
+      auto Stmt = std::move(Work.back());
+      Work.pop_back();
+      if (Stmt)
+        Stmt->takeChildren(Work);
+    }
+  }
+  ASTKind getKind() const override { return ast_block; }
+  const std::vector<std::unique_ptr<StmtAST>> &getStmts() const { return Stmts; }
+  void getChildren(std::vector<StmtAST *> &Children) override
+  {
+    for (auto It = Stmts.rbegin(); It != Stmts.rend(); ++It)
+      Children.push_back(It->get());
+  }
+  void takeChildren(std::vector<std::unique_ptr<StmtAST>> &Children) override
+  {
+    for (auto &Stmt : Stmts)
+      Children.push_back(std::move(Stmt));
+    Stmts.clear();
+  }
 
 #ifdef AST_CODEGEN
   Value *codegen() override;
+  void codegenEnter();
+  void codegenExit();
 #endif
 #ifdef AST_OUTPUT
   void output() override
@@ -217,24 +458,60 @@ public:
 
 class IfElseStmtAST : public StmtAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::unique_ptr<ExprAST> Cond;
   std::unique_ptr<BlockAST> Then;
   std::unique_ptr<BlockAST> Else;
+  /* 1 for likely, -1 for unlikely, 0 without a hint. */
+  int Likely;
 
 public:
   IfElseStmtAST(std::unique_ptr<ExprAST> Cond,
                 std::unique_ptr<BlockAST> Then,
-                std::unique_ptr<BlockAST> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+                std::unique_ptr<BlockAST> Else,
+                int Likely = 0)
+      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)), Likely(Likely) {}
+  ASTKind getKind() const override { return ast_ifelse; }
+  BlockAST *getThen() const { return Then.get(); }
+  BlockAST *getElse() const { return Else.get(); }
+  /* ParseBlock() fills in the blocks once they are parsed. */
+  void setThen(std::unique_ptr<BlockAST> Block) { Then = std::move(Block); }
+  void setElse(std::unique_ptr<BlockAST> Block) { Else = std::move(Block); }
+  void collectOwnCallees(std::set<std::string> &Callees) override
+  {
+    Cond->collectCallees(Callees);
+  }
+  void getChildren(std::vector<StmtAST *> &Children) override
+  {
+    if (Else)
+      Children.push_back(Else.get());
+    if (Then)
+      Children.push_back(Then.get());
+  }
+  void takeChildren(std::vector<std::unique_ptr<StmtAST>> &Children) override
+  {
+    if (Else)
+      Children.push_back(std::move(Else));
+    if (Then)
+      Children.push_back(std::move(Then));
+  }
 
 #ifdef AST_CODEGEN
   Value *codegen() override;
+  /* The branches around Then and Else, BlockAST::codegen() lowers the
+     blocks in between. */
+  bool codegenCond(BasicBlock *&ElseBB, BasicBlock *&MergeBB);
+  void codegenElse(BasicBlock *ElseBB, BasicBlock *MergeBB);
+  Value *codegenMerge(BasicBlock *MergeBB);
 #endif
 #ifdef AST_OUTPUT
   void output() override
   {
     std::cout << "If: ";
     Cond->output();
+    if (Likely)
+      std::cout << (Likely > 0 ? " likely" : " unlikely");
     std::cout << std::endl;
 
     std::cout << "Then: ";
@@ -251,21 +528,51 @@ public:
 
 class WhileStmtAST : public StmtAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::unique_ptr<ExprAST> Cond;
   std::unique_ptr<BlockAST> Loop;
+  /* unroll, vectorize, interleave, distribute and their argument, 0 if
+     none was given. */
+  std::vector<std::pair<std::string, int>> Hints;
 
 public:
-  WhileStmtAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<BlockAST> Loop)
-      : Cond(std::move(Cond)), Loop(std::move(Loop)) {}
+  WhileStmtAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<BlockAST> Loop,
+               std::vector<std::pair<std::string, int>> Hints = {})
+      : Cond(std::move(Cond)), Loop(std::move(Loop)), Hints(std::move(Hints)) {}
+  ASTKind getKind() const override { return ast_while; }
+  BlockAST *getLoop() const { return Loop.get(); }
+  /* ParseBlock() fills in the loop block once it is parsed. */
+  void setLoop(std::unique_ptr<BlockAST> Block) { Loop = std::move(Block); }
+  void collectOwnCallees(std::set<std::string> &Callees) override
+  {
+    Cond->collectCallees(Callees);
+  }
+  void getChildren(std::vector<StmtAST *> &Children) override
+  {
+    if (Loop)
+      Children.push_back(Loop.get());
+  }
+  void takeChildren(std::vector<std::unique_ptr<StmtAST>> &Children) override
+  {
+    if (Loop)
+      Children.push_back(std::move(Loop));
+  }
 
 #ifdef AST_CODEGEN
   Value *codegen() override;
+  /* The condition and the back edge, BlockAST::codegen() lowers the loop
+     block in between. */
+  bool codegenCond(BasicBlock *&CondBB, BasicBlock *&ContBB);
+  Value *codegenBackEdge(BasicBlock *CondBB, BasicBlock *ContBB);
 #endif
 #ifdef AST_OUTPUT
   void output() override
   {
     std::cout << "While: ";
     Cond->output();
+    for (auto &Hint : Hints)
+      std::cout << " " << Hint.first << "(" << Hint.second << ")";
     std::cout << std::endl;
 
     std::cout << "Do: ";
@@ -274,22 +581,98 @@ public:
 #endif
 };
 
+class ParallelForStmtAST : public StmtAST
+{
+  friend class ASTWriter;
+  friend class ASTMemory;
+  std::string Var;
+  std::unique_ptr<ExprAST> Begin, End;
+  /* Fewest iterations one thread runs at a time, null for the default. */
+  std::unique_ptr<ExprAST> Grain;
+  /* Reduction (reduceadd and friends) and the variable it combines into. */
+  std::vector<std::pair<std::string, std::string>> Reductions;
+  std::unique_ptr<BlockAST> Body;
+
+public:
+  ParallelForStmtAST(const std::string &Var,
+                     std::unique_ptr<ExprAST> Begin,
+                     std::unique_ptr<ExprAST> End,
+                     std::unique_ptr<ExprAST> Grain,
+                     std::vector<std::pair<std::string, std::string>> Reductions,
+                     std::unique_ptr<BlockAST> Body)
+      : Var(Var), Begin(std::move(Begin)), End(std::move(End)),
+        Grain(std::move(Grain)), Reductions(std::move(Reductions)),
+        Body(std::move(Body)) {}
+  ASTKind getKind() const override { return ast_parallel_for; }
+  /* ParseBlock() fills in the body once it is parsed. */
+  void setBody(std::unique_ptr<BlockAST> Block) { Body = std::move(Block); }
+  void collectOwnCallees(std::set<std::string> &Callees) override
+  {
+    Begin->collectCallees(Callees);
+    End->collectCallees(Callees);
+    if (Grain)
+      Grain->collectCallees(Callees);
+  }
+  void getChildren(std::vector<StmtAST *> &Children) override
+  {
+    if (Body)
+      Children.push_back(Body.get());
+  }
+  void takeChildren(std::vector<std::unique_ptr<StmtAST>> &Children) override
+  {
+    if (Body)
+      Children.push_back(std::move(Body));
+  }
+
+#ifdef AST_CODEGEN
+  Value *codegen() override;
+  Function *codegenBody(Value *Partials, std::vector<Value *> &Targets,
+                        std::vector<Value *> &Captured);
+#endif
+#ifdef AST_OUTPUT
+  void output() override
+  {
+    std::cout << "Parallel for: " << Var << " = ";
+    Begin->output();
+    std::cout << " to ";
+    End->output();
+    if (Grain)
+    {
+      std::cout << " grain ";
+      Grain->output();
+    }
+    for (auto &Reduction : Reductions)
+      std::cout << " " << Reduction.first << " " << Reduction.second;
+    std::cout << std::endl;
+
+    std::cout << "Do: ";
+    Body->output();
+  }
+#endif
+};
+
 class PrototypeAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::string Name;
   std::vector<std::string> Args;
   std::vector<int> ArgTypes;
   int FnType;
+  /* inline, noinline, hot, cold after the parameter list. */
+  std::vector<std::string> Annotations;
 
 public:
   PrototypeAST(const std::string &Name,
                std::vector<std::string> Args,
                std::vector<int> ArgTypes,
-               const int FnType)
+               const int FnType,
+               std::vector<std::string> Annotations = {})
       : Name(Name),
         Args(std::move(Args)),
         ArgTypes(std::move(ArgTypes)),
-        FnType(FnType) {}
+        FnType(FnType),
+        Annotations(std::move(Annotations)) {}
 #ifdef AST_CODEGEN
   Function *codegen();
 #endif
@@ -312,13 +695,18 @@ public:
     for (auto ArgType : ArgTypes)
       std::cout << " " << ArgType;
     std::cout << ")" << std::endl
-              << "(FnType: " << FnType << "))" << std::endl;
+              << "(FnType: " << FnType << ")";
+    for (auto &Annotation : Annotations)
+      std::cout << " " << Annotation;
+    std::cout << ")" << std::endl;
   }
 #endif
 };
 
 class FunctionAST
 {
+  friend class ASTWriter;
+  friend class ASTMemory;
   std::unique_ptr<PrototypeAST> Proto;
   std::unique_ptr<BlockAST> Body;
 
@@ -326,6 +714,9 @@ public:
   FunctionAST(std::unique_ptr<PrototypeAST> Proto,
               std::unique_ptr<BlockAST> Body)
       : Proto(std::move(Proto)), Body(std::move(Body)) {}
+
+  const std::string &getName() const { return Proto->getName(); }
+  void collectCallees(std::set<std::string> &Callees) { Body->collectCallees(Callees); }
 #ifdef AST_CODEGEN
   Function *codegen();
 #endif
@@ -338,4 +729,51 @@ public:
 #endif
 };
 
+class StructAST
+{
+  friend class ASTWriter;
+  friend class ASTMemory;
+  std::string Name;
+  int Type;
+  /* Arrays of the record keep one array per field instead of one array of
+     records, loops touching few fields then read contiguous memory. */
+  bool SoA;
+  std::vector<std::string> Fields;
+  std::vector<int> FieldTypes;
+
+public:
+  StructAST(const std::string &Name, int Type, bool SoA,
+            std::vector<std::string> Fields,
+            std::vector<int> FieldTypes)
+      : Name(Name), Type(Type), SoA(SoA),
+        Fields(std::move(Fields)),
+        FieldTypes(std::move(FieldTypes)) {}
+#ifdef AST_CODEGEN
+  StructType *codegen();
+  StructType *getColumnsType();
+#endif
+
+  const std::string &getName() const { return Name; }
+  int getType() const { return Type; }
+  bool isSoA() const { return SoA; }
+  const std::vector<std::string> &getFields() const { return Fields; }
+  int getFieldIndex(const std::string &Field) const
+  {
+    for (size_t i = 0; i < Fields.size(); i++)
+      if (Fields[i] == Field)
+        return i;
+    return -1;
+  }
+#ifdef AST_OUTPUT
+  void output()
+  {
+    std::cout << "(Struct: " << Name << (SoA ? " soa" : " aos") << std::endl
+              << "(Fields:";
+    for (size_t i = 0; i < Fields.size(); i++)
+      std::cout << " " << FieldTypes[i] << " " << Fields[i];
+    std::cout << "))" << std::endl;
+  }
+#endif
+};
+
 #endif
@@ -0,0 +1,848 @@
+/* Nodes built here get the same vtables as the ones built by codegen. */
+#include "Codegen.h"
+#include "ASTFile.h"
+#include "Lex.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+
+//===----------------------------------------------------------------------===//
+// Binary AST files. All values are little-endian 32 bits, doubles 64 bits:
+//   header   "BOBOAST\0", version, number of items, offset of the item
+//            table, number of strings, offset of the string table, 0
+//   nodes    kind, then the fields of the class in declaration order; a
+//            string is its index in the string table, a child the offset
+//            of its node (0 for null), a list its length and elements
+//   items    offsets of the top-level nodes in source order
+//   strings  offset and length of each string, then the bytes
+// A node is written after its children, so every child offset is smaller
+// than the offset of its parent. A type is its number from Lex.h, or for
+// structs the high bit, 1 << 30 for arrays of them and the name.
+//===----------------------------------------------------------------------===//
+
+static const char Magic[8] = {'B', 'O', 'B', 'O', 'A', 'S', 'T', 0};
+static const uint32_t Version = 1;
+static const uint32_t HeaderSize = 32;
+static const uint32_t StructBit = 1u << 31, ArrayBit = 1u << 30;
+
+class ASTWriter
+{
+  std::string Out;
+  std::vector<StringRef> Strings;
+  StringMap<uint32_t> StringIds;
+  std::map<int, std::string> StructNames;
+
+  void put(uint32_t V)
+  {
+    char Buf[4];
+    support::endian::write32le(Buf, V);
+    Out.append(Buf, 4);
+  }
+  void putDouble(double V)
+  {
+    char Buf[8];
+    support::endian::write64le(Buf, DoubleToBits(V));
+    Out.append(Buf, 8);
+  }
+  void putString(StringRef S)
+  {
+    auto Id = StringIds.insert({S, Strings.size()});
+    if (Id.second)
+      Strings.push_back(Id.first->getKey());
+    put(Id.first->second);
+  }
+  void putType(int Type)
+  {
+    if (Type < type_struct)
+      return put(Type);
+    bool IsArray = Type >= type_structarray;
+    auto Name = StructNames.find(IsArray ? Type - type_structarray + type_struct : Type);
+    put(StructBit | (IsArray ? ArrayBit : 0));
+    putString(Name == StructNames.end() ? "" : Name->second);
+  }
+  uint32_t begin(ASTKind Kind)
+  {
+    uint32_t Offset = Out.size();
+    put(Kind);
+    return Offset;
+  }
+
+  uint32_t write(const ExprAST *E);
+  uint32_t write(const StmtAST *S);
+  uint32_t writeNode(const StmtAST *S, const std::vector<uint32_t> &Children);
+  uint32_t write(const PrototypeAST &P);
+  uint32_t write(const FunctionAST &F);
+  uint32_t write(const StructAST &S);
+
+public:
+  std::string write(const std::vector<ASTItem> &Items);
+};
+
+uint32_t ASTWriter::write(const ExprAST *E)
+{
+  if (!E)
+    return 0;
+  switch (E->getKind())
+  {
+  case ast_number_double:
+  {
+    auto Offset = begin(ast_number_double);
+    putDouble(static_cast<const NumberDoubleExprAST *>(E)->Val);
+    return Offset;
+  }
+  case ast_number_int:
+  {
+    auto Offset = begin(ast_number_int);
+    put(static_cast<const NumberIntExprAST *>(E)->Val);
+    return Offset;
+  }
+  case ast_variable:
+  {
+    auto Offset = begin(ast_variable);
+    putString(static_cast<const VariableExprAST *>(E)->Name);
+    return Offset;
+  }
+  case ast_index:
+  {
+    auto &N = *static_cast<const IndexExprAST *>(E);
+    auto Index = write(N.Index.get());
+    auto Offset = begin(ast_index);
+    putString(N.Name);
+    put(Index);
+    return Offset;
+  }
+  case ast_field:
+  {
+    auto &N = *static_cast<const FieldExprAST *>(E);
+    auto Index = write(N.Index.get());
+    auto Offset = begin(ast_field);
+    putString(N.Name);
+    put(Index);
+    putString(N.Field);
+    return Offset;
+  }
+  case ast_binary:
+  {
+    /* Operator chains are left-deep, go down the left operands in a loop. */
+    std::vector<const BinaryExprAST *> Chain{static_cast<const BinaryExprAST *>(E)};
+    while (Chain.back()->LHS->getKind() == ast_binary)
+      Chain.push_back(static_cast<const BinaryExprAST *>(Chain.back()->LHS.get()));
+    auto LHS = write(Chain.back()->LHS.get());
+    for (auto It = Chain.rbegin(); It != Chain.rend(); ++It)
+    {
+      auto RHS = write((*It)->RHS.get());
+      auto Offset = begin(ast_binary);
+      put((unsigned char)(*It)->Op);
+      put(LHS);
+      put(RHS);
+      LHS = Offset;
+    }
+    return LHS;
+  }
+  case ast_call:
+  {
+    auto &N = *static_cast<const CallExprAST *>(E);
+    std::vector<uint32_t> Args;
+    for (auto &Arg : N.Args)
+      Args.push_back(write(Arg.get()));
+    auto Offset = begin(ast_call);
+    putString(N.Callee);
+    put(Args.size());
+    for (auto Arg : Args)
+      put(Arg);
+    return Offset;
+  }
+  default:
+    return 0;
+  }
+}
+
+/* Statements with blocks are written off a work stack, nesting depth
+   needs no native stack. A frame holds the offsets of the children written
+   so far, the expressions before the blocks and then the blocks. */
+uint32_t ASTWriter::write(const StmtAST *S)
+{
+  struct Frame
+  {
+    const StmtAST *S;
+    std::vector<const StmtAST *> Blocks;
+    size_t Next;
+    std::vector<uint32_t> Children;
+  };
+  std::vector<Frame> Stack;
+  auto Start = [&](const StmtAST *S)
+  {
+    Frame F{S, {}, 0, {}};
+    switch (S->getKind())
+    {
+    case ast_block:
+      for (auto &Stmt : static_cast<const BlockAST *>(S)->Stmts)
+        F.Blocks.push_back(Stmt.get());
+      break;
+    case ast_ifelse:
+    {
+      auto &N = *static_cast<const IfElseStmtAST *>(S);
+      F.Children.push_back(write(N.Cond.get()));
+      F.Blocks = {N.Then.get(), N.Else.get()};
+      break;
+    }
+    case ast_while:
+    {
+      auto &N = *static_cast<const WhileStmtAST *>(S);
+      F.Children.push_back(write(N.Cond.get()));
+      F.Blocks = {N.Loop.get()};
+      break;
+    }
+    case ast_parallel_for:
+    {
+      auto &N = *static_cast<const ParallelForStmtAST *>(S);
+      F.Children.push_back(write(N.Begin.get()));
+      F.Children.push_back(write(N.End.get()));
+      F.Children.push_back(write(N.Grain.get()));
+      F.Blocks = {N.Body.get()};
+      break;
+    }
+    default:
+      return false;
+    }
+    Stack.push_back(std::move(F));
+    return true;
+  };
+
+  if (!S || !Start(S))
+    return writeNode(S, {});
+  while (true)
+  {
+    auto &F = Stack.back();
+    if (F.Next < F.Blocks.size())
+    {
+      auto Child = F.Blocks[F.Next++];
+      if (!Child || !Start(Child))
+        F.Children.push_back(writeNode(Child, {}));
+      continue;
+    }
+    auto Offset = writeNode(F.S, F.Children);
+    Stack.pop_back();
+    if (Stack.empty())
+      return Offset;
+    Stack.back().Children.push_back(Offset);
+  }
+}
+
+/* S itself once the children of a statement with blocks are written. */
+uint32_t ASTWriter::writeNode(const StmtAST *S, const std::vector<uint32_t> &Children)
+{
+  if (!S)
+    return 0;
+  switch (S->getKind())
+  {
+  case ast_decl:
+  {
+    auto &N = *static_cast<const DeclStmtAST *>(S);
+    std::vector<uint32_t> Sizes;
+    for (auto &Size : N.Sizes)
+      Sizes.push_back(write(Size.get()));
+    auto Offset = begin(ast_decl);
+    putType(N.ValType);
+    put(N.Names.size());
+    for (size_t i = 0; i < N.Names.size(); i++)
+    {
+      putString(N.Names[i]);
+      put(Sizes[i]);
+    }
+    return Offset;
+  }
+  case ast_simp:
+  {
+    auto &N = *static_cast<const SimpStmtAST *>(S);
+    auto Expr = write(N.Expr.get());
+    auto Index = write(N.Index.get());
+    auto Offset = begin(ast_simp);
+    putString(N.Name);
+    put(Expr);
+    put(Index);
+    putString(N.Field);
+    return Offset;
+  }
+  case ast_return:
+  {
+    auto Expr = write(static_cast<const ReturnStmtAST *>(S)->Expr.get());
+    auto Offset = begin(ast_return);
+    put(Expr);
+    return Offset;
+  }
+  case ast_block:
+  {
+    auto Offset = begin(ast_block);
+    put(Children.size());
+    for (auto Stmt : Children)
+      put(Stmt);
+    return Offset;
+  }
+  case ast_ifelse:
+  {
+    auto &N = *static_cast<const IfElseStmtAST *>(S);
+    auto Offset = begin(ast_ifelse);
+    put(Children[0]);
+    put(Children[1]);
+    put(Children[2]);
+    put(N.Likely);
+    return Offset;
+  }
+  case ast_while:
+  {
+    auto &N = *static_cast<const WhileStmtAST *>(S);
+    auto Offset = begin(ast_while);
+    put(Children[0]);
+    put(Children[1]);
+    put(N.Hints.size());
+    for (auto &Hint : N.Hints)
+    {
+      putString(Hint.first);
+      put(Hint.second);
+    }
+    return Offset;
+  }
+  case ast_parallel_for:
+  {
+    auto &N = *static_cast<const ParallelForStmtAST *>(S);
+    auto Offset = begin(ast_parallel_for);
+    putString(N.Var);
+    put(Children[0]);
+    put(Children[1]);
+    put(Children[2]);
+    put(N.Reductions.size());
+    for (auto &Reduction : N.Reductions)
+    {
+      putString(Reduction.first);
+      putString(Reduction.second);
+    }
+    put(Children[3]);
+    return Offset;
+  }
+  default:
+    return 0;
+  }
+}
+
+uint32_t ASTWriter::write(const PrototypeAST &P)
+{
+  auto Offset = begin(ast_prototype);
+  putString(P.Name);
+  put(P.Args.size());
+  for (size_t i = 0; i < P.Args.size(); i++)
+  {
+    putString(P.Args[i]);
+    putType(P.ArgTypes[i]);
+  }
+  putType(P.FnType);
+  put(P.Annotations.size());
+  for (auto &Annotation : P.Annotations)
+    putString(Annotation);
+  return Offset;
+}
+
+uint32_t ASTWriter::write(const FunctionAST &F)
+{
+  auto Proto = write(*F.Proto);
+  auto Body = write(F.Body.get());
+  auto Offset = begin(ast_function);
+  put(Proto);
+  put(Body);
+  return Offset;
+}
+
+uint32_t ASTWriter::write(const StructAST &S)
+{
+  StructNames[S.Type] = S.Name;
+  auto Offset = begin(ast_struct);
+  putString(S.Name);
+  put(S.SoA);
+  put(S.Fields.size());
+  for (size_t i = 0; i < S.Fields.size(); i++)
+  {
+    putString(S.Fields[i]);
+    putType(S.FieldTypes[i]);
+  }
+  return Offset;
+}
+
+std::string ASTWriter::write(const std::vector<ASTItem> &Items)
+{
+  Out.assign(HeaderSize, 0);
+  std::vector<uint32_t> Offsets;
+  for (auto &Item : Items)
+  {
+    if (Item.Extern)
+      Offsets.push_back(write(*Item.Extern));
+    else if (Item.Function)
+      Offsets.push_back(write(*Item.Function));
+    else if (Item.Struct)
+      Offsets.push_back(write(*Item.Struct));
+  }
+
+  uint32_t ItemsOffset = Out.size();
+  for (auto Offset : Offsets)
+    put(Offset);
+
+  uint32_t StringsOffset = Out.size();
+  uint32_t Bytes = StringsOffset + Strings.size() * 8;
+  for (auto S : Strings)
+  {
+    put(Bytes);
+    put(S.size());
+    Bytes += S.size();
+  }
+  for (auto S : Strings)
+    Out += S;
+
+  std::string Header(Magic, sizeof(Magic));
+  for (uint32_t V : {Version, (uint32_t)Offsets.size(), ItemsOffset, (uint32_t)Strings.size(), StringsOffset, 0u})
+  {
+    char Buf[4];
+    support::endian::write32le(Buf, V);
+    Header.append(Buf, 4);
+  }
+  Out.replace(0, HeaderSize, Header);
+  return std::move(Out);
+}
+
+bool writeASTFile(const std::vector<ASTItem> &Items, const std::string &FileName)
+{
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::OF_None);
+  if (EC)
+  {
+    errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+  OS << ASTWriter().write(Items);
+  return true;
+}
+
+/* Reads nodes where the buffer is, strings are only copied into the nodes.
+   Every read is checked, a broken file sets Broken and yields null nodes. */
+class ASTReader
+{
+  StringRef Buffer;
+  uint32_t NumStrings = 0, StringsOffset = 0;
+  std::map<std::string, int> StructTypes;
+  bool Broken = false;
+
+  uint32_t get(uint32_t &Pos)
+  {
+    if (Pos + 4 > Buffer.size() || Pos + 4 < Pos)
+    {
+      Broken = true;
+      return 0;
+    }
+    auto V = support::endian::read32le(Buffer.data() + Pos);
+    Pos += 4;
+    return V;
+  }
+  double getDouble(uint32_t &Pos)
+  {
+    if (Pos + 8 > Buffer.size() || Pos + 8 < Pos)
+    {
+      Broken = true;
+      return 0;
+    }
+    auto V = support::endian::read64le(Buffer.data() + Pos);
+    Pos += 8;
+    return BitsToDouble(V);
+  }
+  StringRef getString(uint32_t &Pos)
+  {
+    auto Id = get(Pos);
+    uint32_t Entry = StringsOffset + Id * 8;
+    if (Id >= NumStrings)
+    {
+      Broken = true;
+      return "";
+    }
+    auto Offset = get(Entry), Length = get(Entry);
+    if ((uint64_t)Offset + Length > Buffer.size())
+    {
+      Broken = true;
+      return "";
+    }
+    return Buffer.substr(Offset, Length);
+  }
+  int getType(uint32_t &Pos)
+  {
+    auto Type = get(Pos);
+    if (!(Type & StructBit))
+      return Type;
+    auto Struct = StructTypes.find(getString(Pos).str());
+    if (Struct == StructTypes.end())
+    {
+      Broken = true;
+      return 0;
+    }
+    return Type & ArrayBit ? Struct->second - type_struct + type_structarray : Struct->second;
+  }
+  /* A child lies before its parent, which also rules out cycles. */
+  uint32_t getChild(uint32_t &Pos, uint32_t Parent)
+  {
+    auto Child = get(Pos);
+    if (Child >= Parent || (Child && Child < HeaderSize))
+    {
+      Broken = true;
+      return 0;
+    }
+    return Child;
+  }
+  uint32_t getKind(uint32_t &Pos, ASTKind Kind)
+  {
+    if (get(Pos) != (uint32_t)Kind)
+      Broken = true;
+    return Pos - 4;
+  }
+
+  std::unique_ptr<ExprAST> readExpr(uint32_t Offset, bool Required = true);
+  std::unique_ptr<StmtAST> readStmt(uint32_t Offset, std::vector<uint32_t> &Blocks);
+  std::unique_ptr<BlockAST> readBlock(uint32_t Offset, bool Required = true);
+  std::unique_ptr<PrototypeAST> readPrototype(uint32_t Offset);
+  std::unique_ptr<FunctionAST> readFunction(uint32_t Offset);
+  std::unique_ptr<StructAST> readStruct(uint32_t Offset);
+
+public:
+  ASTReader(StringRef Buffer) : Buffer(Buffer) {}
+  bool read(std::vector<ASTItem> &Items);
+};
+
+std::unique_ptr<ExprAST> ASTReader::readExpr(uint32_t Offset, bool Required)
+{
+  if (!Offset)
+  {
+    Broken |= Required;
+    return nullptr;
+  }
+  uint32_t Pos = Offset;
+  switch (get(Pos))
+  {
+  case ast_number_double:
+    return std::make_unique<NumberDoubleExprAST>(getDouble(Pos));
+  case ast_number_int:
+    return std::make_unique<NumberIntExprAST>(get(Pos));
+  case ast_variable:
+    return std::make_unique<VariableExprAST>(getString(Pos).str());
+  case ast_index:
+  {
+    auto Name = getString(Pos);
+    auto Index = readExpr(getChild(Pos, Offset));
+    return std::make_unique<IndexExprAST>(Name.str(), std::move(Index));
+  }
+  case ast_field:
+  {
+    auto Name = getString(Pos);
+    auto Index = readExpr(getChild(Pos, Offset), false);
+    auto Field = getString(Pos);
+    return std::make_unique<FieldExprAST>(Name.str(), std::move(Index), Field.str());
+  }
+  case ast_binary:
+  {
+    /* Operators and right operands down the chain of left operands. */
+    std::vector<std::pair<char, uint32_t>> Chain;
+    uint32_t Node = Offset, LHS;
+    while (true)
+    {
+      char Op = get(Pos);
+      LHS = getChild(Pos, Node);
+      Chain.push_back({Op, getChild(Pos, Node)});
+      uint32_t KindPos = LHS;
+      if (!LHS || Broken || get(KindPos) != ast_binary)
+        break;
+      Node = LHS;
+      Pos = KindPos;
+    }
+    auto E = readExpr(LHS);
+    for (auto It = Chain.rbegin(); It != Chain.rend() && !Broken; ++It)
+      E = std::make_unique<BinaryExprAST>(It->first, std::move(E), readExpr(It->second));
+    return E;
+  }
+  case ast_call:
+  {
+    auto Callee = getString(Pos);
+    auto NumArgs = get(Pos);
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    for (uint32_t i = 0; i < NumArgs && !Broken; i++)
+      Args.push_back(readExpr(getChild(Pos, Offset)));
+    return std::make_unique<CallExprAST>(Callee.str(), std::move(Args));
+  }
+  default:
+    Broken = true;
+    return nullptr;
+  }
+}
+
+/* A statement other than a block. An if, while or parallel for comes
+   without its blocks, their offsets are added to Blocks for readBlock(). */
+std::unique_ptr<StmtAST> ASTReader::readStmt(uint32_t Offset, std::vector<uint32_t> &Blocks)
+{
+  if (!Offset)
+  {
+    Broken = true;
+    return nullptr;
+  }
+  uint32_t Pos = Offset;
+  switch (get(Pos))
+  {
+  case ast_decl:
+  {
+    auto Type = getType(Pos);
+    auto NumNames = get(Pos);
+    std::vector<std::string> Names;
+    std::vector<std::unique_ptr<ExprAST>> Sizes;
+    for (uint32_t i = 0; i < NumNames && !Broken; i++)
+    {
+      Names.push_back(getString(Pos).str());
+      Sizes.push_back(readExpr(getChild(Pos, Offset), false));
+    }
+    return std::make_unique<DeclStmtAST>(Type, std::move(Names), std::move(Sizes));
+  }
+  case ast_simp:
+  {
+    auto Name = getString(Pos);
+    auto Expr = readExpr(getChild(Pos, Offset));
+    auto Index = readExpr(getChild(Pos, Offset), false);
+    auto Field = getString(Pos);
+    return std::make_unique<SimpStmtAST>(Name.str(), std::move(Expr), std::move(Index), Field.str());
+  }
+  case ast_return:
+    return std::make_unique<ReturnStmtAST>(readExpr(getChild(Pos, Offset)));
+  case ast_ifelse:
+  {
+    auto Cond = readExpr(getChild(Pos, Offset));
+    Blocks.push_back(getChild(Pos, Offset));
+    Blocks.push_back(getChild(Pos, Offset));
+    int Likely = get(Pos);
+    return std::make_unique<IfElseStmtAST>(std::move(Cond), nullptr, nullptr, Likely);
+  }
+  case ast_while:
+  {
+    auto Cond = readExpr(getChild(Pos, Offset));
+    Blocks.push_back(getChild(Pos, Offset));
+    auto NumHints = get(Pos);
+    std::vector<std::pair<std::string, int>> Hints;
+    for (uint32_t i = 0; i < NumHints && !Broken; i++)
+    {
+      auto Hint = getString(Pos);
+      Hints.push_back({Hint.str(), (int)get(Pos)});
+    }
+    return std::make_unique<WhileStmtAST>(std::move(Cond), nullptr, std::move(Hints));
+  }
+  case ast_parallel_for:
+  {
+    auto Var = getString(Pos);
+    auto Begin = readExpr(getChild(Pos, Offset));
+    auto End = readExpr(getChild(Pos, Offset));
+    auto Grain = readExpr(getChild(Pos, Offset), false);
+    auto NumReductions = get(Pos);
+    std::vector<std::pair<std::string, std::string>> Reductions;
+    for (uint32_t i = 0; i < NumReductions && !Broken; i++)
+    {
+      auto Kind = getString(Pos);
+      Reductions.push_back({Kind.str(), getString(Pos).str()});
+    }
+    Blocks.push_back(getChild(Pos, Offset));
+    return std::make_unique<ParallelForStmtAST>(Var.str(), std::move(Begin), std::move(End), std::move(Grain),
+                                                std::move(Reductions), nullptr);
+  }
+  default:
+    Broken = true;
+    return nullptr;
+  }
+}
+
+/* Nested blocks are read off a work stack, nesting depth needs no native
+   stack. A block of an if, while or parallel for is set on it once all of
+   its statements are read. */
+std::unique_ptr<BlockAST> ASTReader::readBlock(uint32_t Offset, bool Required)
+{
+  struct OpenBlock
+  {
+    uint32_t Offset, Pos, Left;
+    std::vector<std::unique_ptr<StmtAST>> Stmts;
+    /* Statement the block belongs to, null for one inside a block. Slot 1
+       is the else block of an if, 0 any other block. */
+    StmtAST *Owner;
+    int Slot;
+  };
+  std::vector<OpenBlock> Open;
+  auto Start = [&](uint32_t Offset, StmtAST *Owner, int Slot)
+  {
+    uint32_t Pos = Offset;
+    getKind(Pos, ast_block);
+    auto Left = get(Pos);
+    Open.push_back({Offset, Pos, Left, {}, Owner, Slot});
+  };
+
+  if (!Offset)
+  {
+    Broken |= Required;
+    return nullptr;
+  }
+  Start(Offset, nullptr, 0);
+  while (true)
+  {
+    auto &B = Open.back();
+    if (B.Left && !Broken)
+    {
+      B.Left--;
+      auto Child = getChild(B.Pos, B.Offset);
+      uint32_t KindPos = Child;
+      if (Child && get(KindPos) == ast_block)
+      {
+        Start(Child, nullptr, 0);
+        continue;
+      }
+      std::vector<uint32_t> Blocks;
+      auto Stmt = readStmt(Child, Blocks);
+      auto Owner = Stmt.get();
+      B.Stmts.push_back(std::move(Stmt));
+      for (int Slot = Blocks.size() - 1; Slot >= 0; Slot--)
+        if (Blocks[Slot])
+          Start(Blocks[Slot], Owner, Slot);
+        else
+          Broken |= Slot == 0;
+      continue;
+    }
+
+    auto Block = std::make_unique<BlockAST>(std::move(B.Stmts));
+    auto Owner = B.Owner;
+    int Slot = B.Slot;
+    Open.pop_back();
+    if (Open.empty())
+      return Block;
+    if (!Owner)
+      Open.back().Stmts.push_back(std::move(Block));
+    else if (Owner->getKind() == ast_ifelse && Slot)
+      static_cast<IfElseStmtAST *>(Owner)->setElse(std::move(Block));
+    else if (Owner->getKind() == ast_ifelse)
+      static_cast<IfElseStmtAST *>(Owner)->setThen(std::move(Block));
+    else if (Owner->getKind() == ast_while)
+      static_cast<WhileStmtAST *>(Owner)->setLoop(std::move(Block));
+    else
+      static_cast<ParallelForStmtAST *>(Owner)->setBody(std::move(Block));
+  }
+}
+
+std::unique_ptr<PrototypeAST> ASTReader::readPrototype(uint32_t Offset)
+{
+  uint32_t Pos = Offset;
+  getKind(Pos, ast_prototype);
+  auto Name = getString(Pos);
+  auto NumArgs = get(Pos);
+  std::vector<std::string> Args;
+  std::vector<int> ArgTypes;
+  for (uint32_t i = 0; i < NumArgs && !Broken; i++)
+  {
+    Args.push_back(getString(Pos).str());
+    ArgTypes.push_back(getType(Pos));
+  }
+  auto FnType = getType(Pos);
+  auto NumAnnotations = get(Pos);
+  std::vector<std::string> Annotations;
+  for (uint32_t i = 0; i < NumAnnotations && !Broken; i++)
+    Annotations.push_back(getString(Pos).str());
+  return std::make_unique<PrototypeAST>(Name.str(), std::move(Args), std::move(ArgTypes), FnType, std::move(Annotations));
+}
+
+std::unique_ptr<FunctionAST> ASTReader::readFunction(uint32_t Offset)
+{
+  uint32_t Pos = Offset;
+  getKind(Pos, ast_function);
+  auto Proto = getChild(Pos, Offset);
+  auto Body = readBlock(getChild(Pos, Offset));
+  if (!Proto)
+    Broken = true;
+  return std::make_unique<FunctionAST>(readPrototype(Proto), std::move(Body));
+}
+
+std::unique_ptr<StructAST> ASTReader::readStruct(uint32_t Offset)
+{
+  uint32_t Pos = Offset;
+  getKind(Pos, ast_struct);
+  auto Name = getString(Pos).str();
+  bool SoA = get(Pos);
+  auto NumFields = get(Pos);
+  std::vector<std::string> Fields;
+  std::vector<int> FieldTypes;
+  for (uint32_t i = 0; i < NumFields && !Broken; i++)
+  {
+    Fields.push_back(getString(Pos).str());
+    FieldTypes.push_back(getType(Pos));
+  }
+  if (Broken)
+    return nullptr;
+
+  int Type = addStructType(Name);
+  if (Type < 0)
+  {
+    fprintf(stderr, "Error: Struct name is already used\n");
+    return nullptr;
+  }
+  StructTypes[Name] = Type;
+  return std::make_unique<StructAST>(Name, Type, SoA, std::move(Fields), std::move(FieldTypes));
+}
+
+bool ASTReader::read(std::vector<ASTItem> &Items)
+{
+  if (Buffer.size() < HeaderSize || !Buffer.startswith(StringRef(Magic, sizeof(Magic))))
+    return false;
+  uint32_t Pos = sizeof(Magic);
+  if (get(Pos) != Version)
+  {
+    errs() << "The AST file was written by another version";
+    return false;
+  }
+  auto NumItems = get(Pos), ItemsOffset = get(Pos);
+  NumStrings = get(Pos);
+  StringsOffset = get(Pos);
+
+  for (uint32_t i = 0; i < NumItems && !Broken; i++)
+  {
+    auto Offset = get(ItemsOffset);
+    if (Offset < HeaderSize || Offset >= Buffer.size())
+      return false;
+    uint32_t KindPos = Offset;
+    ASTItem Item;
+    switch (get(KindPos))
+    {
+    case ast_prototype:
+      Item.Extern = readPrototype(Offset);
+      break;
+    case ast_function:
+      Item.Function = readFunction(Offset);
+      break;
+    case ast_struct:
+      if (!(Item.Struct = readStruct(Offset)))
+        return false;
+      break;
+    default:
+      Broken = true;
+    }
+    Items.push_back(std::move(Item));
+  }
+  return !Broken;
+}
+
+bool readASTFile(const std::string &FileName, std::vector<ASTItem> &Items)
+{
+  auto BufferOrErr = MemoryBuffer::getFile(FileName);
+  if (!BufferOrErr)
+  {
+    errs() << "The file '" << FileName << "' is not existed";
+    return false;
+  }
+  if (!ASTReader((*BufferOrErr)->getBuffer()).read(Items))
+  {
+    errs() << "The file '" << FileName << "' is not a valid AST file";
+    return false;
+  }
+  return true;
+}
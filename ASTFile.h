@@ -0,0 +1,26 @@
+#ifndef ASTFILE_H
+#define ASTFILE_H
+#include "AST.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+/* A top-level item of a source file, exactly one member is set. */
+struct ASTItem
+{
+  std::unique_ptr<PrototypeAST> Extern;
+  std::unique_ptr<FunctionAST> Function;
+  std::unique_ptr<StructAST> Struct;
+};
+
+/* --emit-ast: write the items to a binary file. Nodes are stored children
+   first and refer to them by file offset, names go through a string table,
+   so a file is read where it is mapped without any lexing or parsing. */
+bool writeASTFile(const std::vector<ASTItem> &Items, const std::string &FileName);
+
+/* --import=file: read the items back. Struct names are registered with the
+   lexer as ParseStructDeclaration() does, types referring to them are
+   renumbered to the new struct types. */
+bool readASTFile(const std::string &FileName, std::vector<ASTItem> &Items);
+
+#endif
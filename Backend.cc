@@ -0,0 +1,154 @@
+#include "Backend.h"
+#include "TimeTrace.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <vector>
+
+unsigned BackendJobs = 0;
+
+/* Instructions per partition. Inlining is done by now, small partitions
+   only cost the calls between them. */
+static const size_t PartitionSize = 2000;
+static const size_t MaxPartitions = 32;
+
+static unsigned getNumPartitions(Module &M)
+{
+  size_t Size = 0;
+  for (auto &F : M)
+    Size += F.getInstructionCount();
+  return std::max<size_t>(1, std::min(MaxPartitions, (Size + PartitionSize - 1) / PartitionSize));
+}
+
+bool emitObject(Module &M, TargetMachine &TM, raw_pwrite_stream &OS)
+{
+  TimeTraceScope Scope("EmitObject", M.getModuleIdentifier());
+  legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile))
+  {
+    errs() << "TheTargetMachine can't emit a file of this type";
+    return false;
+  }
+  PM.run(M);
+  return true;
+}
+
+static std::string partitionName(StringRef Output, unsigned Part)
+{
+  StringRef Stem = Output;
+  Stem.consume_back(".o");
+  return (Stem + ".part" + Twine(Part) + ".o").str();
+}
+
+bool mergeObjects(const std::vector<std::string> &Inputs, const std::string &Output)
+{
+  auto Ld = sys::findProgramByName("ld");
+  if (!Ld)
+  {
+    errs() << "ld is needed to merge the objects";
+    return false;
+  }
+  /* --cache passes one object per function, too many for a command line. */
+  int FD;
+  SmallString<128> ResponseFile;
+  if (sys::fs::createTemporaryFile("bobo-ld", "rsp", FD, ResponseFile))
+  {
+    errs() << "Could not create a response file for ld";
+    return false;
+  }
+  {
+    raw_fd_ostream OS(FD, true);
+    for (auto &Input : Inputs)
+    {
+      OS << '"';
+      for (auto C : Input)
+      {
+        if (C == '"' || C == '\\')
+          OS << '\\';
+        OS << C;
+      }
+      OS << "\"\n";
+    }
+  }
+
+  auto InputsArg = ("@" + ResponseFile).str();
+  std::vector<StringRef> Args{*Ld, "-r", "-o", Output, InputsArg};
+  std::string ErrMsg;
+  bool Failed = sys::ExecuteAndWait(*Ld, Args, None, {}, 0, 0, &ErrMsg);
+  sys::fs::remove(ResponseFile);
+  if (Failed)
+  {
+    errs() << "ld -r failed " << ErrMsg;
+    return false;
+  }
+  return true;
+}
+
+bool emitObjectFile(Module &M, const TargetMachineFactory &CreateTM, const std::string &Output)
+{
+  unsigned NumParts = BackendJobs ? getNumPartitions(M) : 1;
+  if (NumParts == 1)
+  {
+    std::error_code EC;
+    raw_fd_ostream Dest(Output, EC, sys::fs::OF_None);
+    if (EC)
+    {
+      errs() << "Could not open file: " << EC.message();
+      return false;
+    }
+    return emitObject(M, *CreateTM(), Dest);
+  }
+
+  /* Every partition gets a context of its own through bitcode, a context
+     can't be used by two threads. */
+  std::vector<SmallString<0>> Bitcode;
+  SplitModule(M, NumParts, [&](std::unique_ptr<Module> Part)
+              {
+                Bitcode.emplace_back();
+                raw_svector_ostream OS(Bitcode.back());
+                WriteBitcodeToFile(*Part, OS); });
+
+  std::vector<SmallString<0>> Objects(NumParts);
+  std::vector<char> Ok(NumParts);
+  bool Tracing = timeTraceProfilerEnabled();
+  ThreadPool Pool(hardware_concurrency(BackendJobs));
+  for (unsigned i = 0; i < NumParts; i++)
+    Pool.async([&, i]
+               {
+                 TimeTraceThread Thread(Tracing);
+                 LLVMContext Ctx;
+                 auto PartOrErr = parseBitcodeFile(MemoryBufferRef(Bitcode[i].str(), "partition"), Ctx);
+                 if (!PartOrErr)
+                 {
+                   consumeError(PartOrErr.takeError());
+                   return;
+                 }
+                 raw_svector_ostream OS(Objects[i]);
+                 Ok[i] = emitObject(**PartOrErr, *CreateTM(), OS); });
+  Pool.wait();
+
+  std::vector<std::string> Inputs;
+  bool Written = true;
+  for (unsigned i = 0; i < NumParts && Written; i++)
+  {
+    Inputs.push_back(partitionName(Output, i + 1));
+    std::error_code EC;
+    raw_fd_ostream Dest(Inputs.back(), EC, sys::fs::OF_None);
+    if (EC || !Ok[i])
+    {
+      errs() << "Could not write partition " << i + 1;
+      Written = false;
+    }
+    else
+      Dest << Objects[i];
+  }
+  Written = Written && mergeObjects(Inputs, Output);
+  for (auto &Input : Inputs)
+    sys::fs::remove(Input);
+  return Written;
+}
@@ -0,0 +1,29 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+typedef std::function<std::unique_ptr<TargetMachine>()> TargetMachineFactory;
+
+/* -j N: run the backend on N threads over partitions of the module, 0 keeps
+   the whole module in a single backend run. */
+extern unsigned BackendJobs;
+
+/* Run the backend on M alone. */
+bool emitObject(Module &M, TargetMachine &TM, raw_pwrite_stream &OS);
+
+/* Write M as an object file. Partitions are compiled to objects of their
+   own and merged with ld -r. How the module is split only depends on the
+   module, so the object is the same for every N. */
+bool emitObjectFile(Module &M, const TargetMachineFactory &CreateTM, const std::string &Output);
+
+/* Merge relocatable objects into Output with ld -r. */
+bool mergeObjects(const std::vector<std::string> &Inputs, const std::string &Output);
+
+#endif
@@ -0,0 +1,188 @@
+#include "Cache.h"
+#include "Optimize.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Caching.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include <vector>
+
+std::string CacheDir;
+uint64_t CacheSize = 1024;
+
+/* Callees copied in for the inliner, the limit ThinLTO imports with. */
+static const unsigned ImportLimit = 100;
+
+std::string getCacheOptions(const TargetMachine &TM, unsigned OptLevel)
+{
+  return (Twine(LLVM_VERSION_STRING) + " -O" + Twine(OptLevel) + " -mcpu=" + TM.getTargetCPU() +
+          " -mattr=" + TM.getTargetFeatureString() + " -fveclib=" + Twine((int)VecLib))
+      .str();
+}
+
+std::string getCacheKey(const Module &M, const std::string &Options)
+{
+  SmallString<0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(M, OS);
+  SHA1 Hasher;
+  Hasher.update(Options);
+  Hasher.update(Bitcode);
+  return toHex(Hasher.result());
+}
+
+static std::string getCachePath(StringRef Key)
+{
+  SmallString<128> Path(CacheDir);
+  sys::path::append(Path, "llvmcache-" + Key);
+  return Path.str().str();
+}
+
+static Expected<FileCache> openCache()
+{
+  return localCache("BoboLang", "bobo-tmp", CacheDir);
+}
+
+static void pruneObjectCache()
+{
+  CachePruningPolicy Policy;
+  Policy.Interval = std::chrono::seconds(0);
+  Policy.MaxSizeBytes = CacheSize << 20;
+  pruneCache(CacheDir, Policy);
+}
+
+static bool refersToLocals(Function &F)
+{
+  for (auto &I : instructions(F))
+    for (auto &Op : I.operands())
+      if (auto GV = dyn_cast<GlobalValue>(Op->stripPointerCasts()))
+        if (GV->hasLocalLinkage())
+          return true;
+  return false;
+}
+
+/* F and the local functions it refers to, the bodies of its parallel for
+   loops, which are compiled with it. */
+static std::vector<Function *> getUnit(Function &F)
+{
+  std::vector<Function *> Unit{&F};
+  for (size_t i = 0; i < Unit.size(); i++)
+    for (auto &I : instructions(*Unit[i]))
+      for (auto &Op : I.operands())
+        if (auto G = dyn_cast<Function>(Op->stripPointerCasts()))
+          if (G->hasLocalLinkage() && !G->isDeclaration() && !is_contained(Unit, G))
+            Unit.push_back(G);
+  return Unit;
+}
+
+static std::vector<Function *> getImports(const std::vector<Function *> &Unit)
+{
+  std::vector<Function *> Imports;
+  for (auto F : Unit)
+    for (auto &I : instructions(*F))
+    {
+      auto Call = dyn_cast<CallBase>(&I);
+      auto Callee = Call ? Call->getCalledFunction() : nullptr;
+      if (!Callee || Callee->isDeclaration() || Callee->hasLocalLinkage() ||
+          is_contained(Unit, Callee) || is_contained(Imports, Callee))
+        continue;
+      if (Callee->getInstructionCount() <= ImportLimit && !refersToLocals(*Callee))
+        Imports.push_back(Callee);
+    }
+  return Imports;
+}
+
+bool emitCachedObjectFile(Module &M, const TargetMachineFactory &CreateTM, unsigned OptLevel, const std::string &Output)
+{
+  auto CacheOrErr = openCache();
+  if (!CacheOrErr)
+  {
+    errs() << toString(CacheOrErr.takeError());
+    return false;
+  }
+  auto TM = CreateTM();
+  auto Options = getCacheOptions(*TM, OptLevel);
+
+  std::vector<std::string> Objects;
+  unsigned Compiled = 0;
+  for (auto &F : M)
+  {
+    if (F.isDeclaration() || F.hasLocalLinkage())
+      continue;
+    auto Unit = getUnit(F);
+    auto Part = extractFunctions(M, Unit, getImports(Unit));
+    auto Key = getCacheKey(*Part, Options);
+    auto AddStreamOrErr = (*CacheOrErr)(0, Key);
+    if (!AddStreamOrErr)
+    {
+      errs() << toString(AddStreamOrErr.takeError());
+      return false;
+    }
+    /* A miss, the object is moved into the cache once the stream is gone. */
+    if (*AddStreamOrErr)
+    {
+      auto StreamOrErr = (*AddStreamOrErr)(0);
+      if (!StreamOrErr)
+      {
+        errs() << toString(StreamOrErr.takeError());
+        return false;
+      }
+      if (!optimizeModule(*Part, TM.get(), OptLevel) || !emitObject(*Part, *TM, *(*StreamOrErr)->OS))
+        return false;
+      Compiled++;
+    }
+    Objects.push_back(getCachePath(Key));
+  }
+  if (Objects.empty())
+    return emitObjectFile(M, CreateTM, Output);
+
+  outs() << "Compiled " << Compiled << " of " << Objects.size() << " functions, the others came from " << CacheDir << "\n";
+  bool Merged = mergeObjects(Objects, Output);
+  pruneObjectCache();
+  return Merged;
+}
+
+void ObjectFileCache::notifyObjectCompiled(const Module *M, MemoryBufferRef Obj)
+{
+  std::string Key;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto KI = Keys.find(M);
+    if (KI == Keys.end())
+      return;
+    Key = KI->second;
+    Keys.erase(KI);
+  }
+
+  auto CacheOrErr = openCache();
+  if (!CacheOrErr)
+  {
+    consumeError(CacheOrErr.takeError());
+    return;
+  }
+  auto AddStreamOrErr = (*CacheOrErr)(0, Key);
+  if (!AddStreamOrErr || !*AddStreamOrErr)
+  {
+    consumeError(AddStreamOrErr.takeError());
+    return;
+  }
+  if (auto StreamOrErr = (*AddStreamOrErr)(0))
+    *(*StreamOrErr)->OS << Obj.getBuffer();
+  else
+    consumeError(StreamOrErr.takeError());
+  pruneObjectCache();
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getObject(const Module *M)
+{
+  auto Key = getCacheKey(*M, Options);
+  if (auto Buffer = MemoryBuffer::getFile(getCachePath(Key)))
+    return std::move(*Buffer);
+  std::lock_guard<std::mutex> Guard(Lock);
+  Keys[M] = Key;
+  return nullptr;
+}
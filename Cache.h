@@ -0,0 +1,38 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include "Backend.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include <map>
+#include <mutex>
+
+/* --cache=dir: every function is optimized and compiled on its own, its
+   object is kept in dir under a hash of its IR and the options. The IR
+   carries the signatures and attributes of the functions it calls, small
+   callees are copied in for the inliner. */
+extern std::string CacheDir;
+
+/* --cache-size=N: prune the cache to N megabytes, least recently used
+   objects first. */
+extern uint64_t CacheSize;
+
+/* Options that change the code generated from the same IR. */
+std::string getCacheOptions(const TargetMachine &TM, unsigned OptLevel);
+std::string getCacheKey(const Module &M, const std::string &Options);
+
+/* Write M as an object file, compiling only the functions not cached. */
+bool emitCachedObjectFile(Module &M, const TargetMachineFactory &CreateTM, unsigned OptLevel, const std::string &Output);
+
+/* The same cache for the JIT, keyed by the whole module it compiles. */
+class ObjectFileCache : public ObjectCache
+{
+  std::string Options;
+  std::mutex Lock;
+  std::map<const Module *, std::string> Keys;
+
+public:
+  ObjectFileCache(std::string Options) : Options(std::move(Options)) {}
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override;
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override;
+};
+
+#endif
@@ -1,39 +1,159 @@
 #include "Lex.h"
 #include "Codegen.h"
+#include "MemReport.h"
+#include "Profile.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/TimeProfiler.h"
 #include <map>
 #include <memory>
-#include <list>
+#include <set>
 
 /* Global flag indicates BlockAST::codegen() should copy args. */
 static bool IsFunctionBlock = false;
 
-/* Variables of scope stack */
-static std::list<std::unique_ptr<std::map<std::string, Value *>>> NamedValuesScope;
+/* Signed overflow is undefined and well-known math functions become intrinsics. */
+bool NumericMode = false;
 
-/* Variables on heap, GC heaper */
-static std::list<std::unique_ptr<std::map<std::string, Value *>>> HeapValuesScope;
+/* Self tail calls jump here instead of calling, see ReturnStmtAST::codegen(). */
+bool TailRecursionToLoop = true;
+static Instruction *ArgsSetupEnd = nullptr;
+static BasicBlock *TailRecurseBB = nullptr;
 
-static Value *findVar(std::string Name)
+/* Variables in scope: every name has the stack of its bindings, innermost
+   last, each with the nesting depth of the block that declared it. A block
+   keeps the names it declared and pops them when it closes, so looking a
+   name up costs the same at any depth. */
+struct Binding
 {
-  for (auto &Scope : NamedValuesScope)
+  unsigned Depth;
+  Value *V;
+};
+using BindingStack = StringMapEntry<SmallVector<Binding, 1>>;
+
+/* Variables on heap, GC heaper. Only blocks that allocate get an entry,
+   its cells are freed in name order when the block closes. */
+struct HeapCells
+{
+  unsigned Depth;
+  std::map<std::string, Value *> Cells;
+};
+
+struct ScopeStack
+{
+  StringMap<SmallVector<Binding, 1>> Vars;
+  std::vector<std::vector<BindingStack *>> Declared;
+  size_t NumVars = 0;
+  std::vector<HeapCells> Heap;
+  DenseMap<Value *, unsigned> HeapRefs;
+  size_t NumHeapValues = 0;
+};
+static ScopeStack Scopes;
+
+/* A parallel for body is outlined into its own function. Variables of the
+   function around it reach the body through a context array the runtime
+   passes to every chunk, see ParallelForStmtAST::codegen(). */
+struct ParallelOutline
+{
+  ScopeStack Outer;
+  Argument *Ctx;
+  std::vector<Value *> &Captured;
+  std::set<Value *> ReadOnly;
+};
+static ParallelOutline *Outline = nullptr;
+
+/* Record names never contain '.', so the suffix identifies soa columns. */
+static bool isColumns(Type *Ty)
+{
+  auto STy = dyn_cast<StructType>(Ty);
+  return STy && STy->hasName() && STy->getName().endswith(".soa");
+}
+
+/* Arrays and heap cells are shared. Stack variables are copied when a chunk
+   starts and may only be read, so they stay in registers. The copy of a
+   soa array's column pointers still points at the shared columns. */
+static Value *captureValue(Value *V)
+{
+  auto &Entry = Outline->Ctx->getParent()->getEntryBlock();
+  IRBuilder<> TmpB(&Entry, Entry.begin());
+  auto Ty = V->getType();
+  auto Slot = TmpB.CreateConstInBoundsGEP1_64(TmpB.getInt8PtrTy(), Outline->Ctx, Outline->Captured.size());
+  Outline->Captured.push_back(V);
+  Value *Captured = TmpB.CreateLoad(Ty, TmpB.CreateBitCast(Slot, Ty->getPointerTo()), V->getName());
+  if (!isa<AllocaInst>(V))
+    return Captured;
+
+  auto ElTy = Ty->getPointerElementType();
+  auto Copy = TmpB.CreateAlloca(ElTy, nullptr, V->getName());
+  TmpB.CreateStore(TmpB.CreateLoad(ElTy, Captured), Copy);
+  if (!isColumns(ElTy))
+    Outline->ReadOnly.insert(Copy);
+  return Copy;
+}
+
+static void pushBinding(BindingStack &Stack, unsigned Depth, Value *V)
+{
+  Stack.second.push_back({Depth, V});
+  Scopes.Declared[Depth - 1].push_back(&Stack);
+  Scopes.NumVars++;
+}
+
+static Value *findVar(StringRef Name)
+{
+  auto It = Scopes.Vars.find(Name);
+  if (It != Scopes.Vars.end() && !It->second.empty())
+    return It->second.back().V;
+
+  if (Outline)
   {
-    if (Scope->find(Name) != Scope->end())
-      return (*Scope)[Name];
+    auto OI = Outline->Outer.Vars.find(Name);
+    if (OI == Outline->Outer.Vars.end() || OI->second.empty())
+      return nullptr;
+    /* Captured once, in the outermost block of the body. */
+    auto V = captureValue(OI->second.back().V);
+    pushBinding(*Scopes.Vars.try_emplace(Name).first, 1, V);
+    return V;
   }
   return nullptr;
 }
 
-static bool addVar(std::string Name, Value *Value, bool onHeap = false)
+/* The cells of the innermost block, made on its first allocation. */
+static std::map<std::string, Value *> &getBlockHeap()
+{
+  unsigned Depth = Scopes.Declared.size();
+  if (Scopes.Heap.empty() || Scopes.Heap.back().Depth != Depth)
+    Scopes.Heap.push_back({Depth, {}});
+  return Scopes.Heap.back().Cells;
+}
+
+static void addHeapValue(const std::string &Name, Value *V)
 {
-  auto &Scope = NamedValuesScope.front();
-  if (Scope->find(Name) != Scope->end())
+  auto &Cell = getBlockHeap()[Name];
+  if (Cell)
+    Scopes.HeapRefs[Cell]--;
+  else
+    Scopes.NumHeapValues++;
+  Cell = V;
+  Scopes.HeapRefs[V]++;
+}
+
+static bool addVar(StringRef Name, Value *Value, bool onHeap = false)
+{
+  unsigned Depth = Scopes.Declared.size();
+  auto &Stack = *Scopes.Vars.try_emplace(Name).first;
+  if (!Stack.second.empty() && Stack.second.back().Depth == Depth)
     return false;
 
-  (*Scope)[Name] = Value;
+  pushBinding(Stack, Depth, Value);
   if (onHeap)
-    (*HeapValuesScope.front())[Name] = Value;
+    addHeapValue(Name.str(), Value);
   return true;
 }
 
@@ -62,23 +182,213 @@ static Function *LogErrorF(const char *Str)
   return nullptr;
 }
 
+/* Struct declarations by type, see addStructType(). */
+std::map<int, std::unique_ptr<StructAST>> StructDecls;
+static StructAST *getStruct(int ValType)
+{
+  auto SI = StructDecls.find(ValType);
+  return SI == StructDecls.end() ? nullptr : SI->second.get();
+}
+
+/* Arrays are heap blocks typed [0 x T], so they never mix with Int/Double cells. */
+static PointerType *getArrayPtrType(Type *ElTy)
+{
+  return PointerType::get(ArrayType::get(ElTy, 0), IntPtrType->getAddressSpace());
+}
+
+static bool isArray(Value *V)
+{
+  auto Ty = V->getType();
+  return Ty->isPointerTy() && Ty->getPointerElementType()->isArrayTy();
+}
+
+/* LLVM type of a variable, parameter or return value. double2/4/8 and
+   int4/8 map to fixed vectors, passed in vector registers. A record is a
+   named struct passed by value, an array of records is an array of those
+   structs or, for soa records, the struct of its columns. */
+static Type *getValueType(int ValType)
+{
+  auto AS = IntPtrType->getAddressSpace();
+  switch (ValType)
+  {
+  case type_int:
+    return IntType;
+  case type_double:
+    return FPType;
+  case type_int32:
+    return Builder->getInt32Ty();
+  case type_float:
+    return Builder->getFloatTy();
+  case type_intptr:
+    return IntPtrType;
+  case type_doubleptr:
+    return FPPtrType;
+  case type_int32ptr:
+    return PointerType::get(Builder->getInt32Ty(), AS);
+  case type_floatptr:
+    return PointerType::get(Builder->getFloatTy(), AS);
+  case type_intarray:
+    return getArrayPtrType(IntType);
+  case type_doublearray:
+    return getArrayPtrType(FPType);
+  case type_int32array:
+    return getArrayPtrType(Builder->getInt32Ty());
+  case type_floatarray:
+    return getArrayPtrType(Builder->getFloatTy());
+  case type_double2:
+    return FixedVectorType::get(FPType, 2);
+  case type_double4:
+    return FixedVectorType::get(FPType, 4);
+  case type_double8:
+    return FixedVectorType::get(FPType, 8);
+  case type_int4:
+    return FixedVectorType::get(IntType, 4);
+  case type_int8:
+    return FixedVectorType::get(IntType, 8);
+  }
+
+  if (ValType >= type_structarray)
+  {
+    auto S = getStruct(ValType - type_structarray + type_struct);
+    if (!S)
+      return nullptr;
+    if (S->isSoA())
+      return S->getColumnsType();
+    auto Record = S->codegen();
+    return Record ? getArrayPtrType(Record) : nullptr;
+  }
+  if (auto S = getStruct(ValType))
+    return S->codegen();
+  return nullptr;
+}
+
+StructType *StructAST::codegen()
+{
+  if (auto Ty = StructType::getTypeByName(*TheContext, Name))
+    return Ty;
+
+  std::vector<llvm::Type *> Elements;
+  for (size_t i = 0; i < Fields.size(); i++)
+  {
+    auto Ty = getValueType(FieldTypes[i]);
+    if (!Ty || !(Ty->isIntegerTy() || Ty->isFloatingPointTy()))
+    {
+      LogErrorV("fields must be int, double, int32 or float");
+      return nullptr;
+    }
+    if (getFieldIndex(Fields[i]) != (int)i)
+    {
+      LogErrorV("duplicate field");
+      return nullptr;
+    }
+    Elements.push_back(Ty);
+  }
+  return StructType::create(*TheContext, Elements, Name);
+}
+
+/* One [0 x T] array per field, named after the record with a ".soa" suffix. */
+StructType *StructAST::getColumnsType()
+{
+  auto ColumnsName = Name + ".soa";
+  if (auto Ty = StructType::getTypeByName(*TheContext, ColumnsName))
+    return Ty;
+
+  auto Record = codegen();
+  if (!Record)
+    return nullptr;
+  std::vector<llvm::Type *> Columns;
+  for (auto ElTy : Record->elements())
+    Columns.push_back(getArrayPtrType(ElTy));
+  return StructType::create(*TheContext, Columns, ColumnsName);
+}
+
+static StructAST *getStructOf(StructType *Ty)
+{
+  auto Name = Ty->getName();
+  Name.consume_back(".soa");
+  for (auto &S : StructDecls)
+    if (S.second->getName() == Name)
+      return S.second.get();
+  return nullptr;
+}
+
+static bool isVectorSlot(Value *V)
+{
+  auto Ty = V->getType();
+  return Ty->isPointerTy() && Ty->getPointerElementType()->isVectorTy();
+}
+
+/* As in C: floating point wins over integers, then the wider type, and
+   comparison results count as int32. */
+static Type *commonScalarType(Type *Ty1, Type *Ty2)
+{
+  if (Ty1->isFloatingPointTy() != Ty2->isFloatingPointTy())
+    return Ty1->isFloatingPointTy() ? Ty1 : Ty2;
+  if (Ty1->isFloatingPointTy())
+    return Ty1->getPrimitiveSizeInBits() >= Ty2->getPrimitiveSizeInBits() ? Ty1 : Ty2;
+  if (!Ty1->isIntegerTy() || !Ty2->isIntegerTy())
+    return nullptr;
+  auto Bits = std::max({Ty1->getIntegerBitWidth(), Ty2->getIntegerBitWidth(), 32u});
+  return Builder->getIntNTy(Bits);
+}
+
+/* Scalars mixed with vectors are splat, vectors must have the same length. */
 static Type *lowestCommonType(Type *Ty1, Type *Ty2)
 {
   if (Ty1->isPointerTy())
     Ty1 = Ty1->getPointerElementType();
   if (Ty2->isPointerTy())
-    Ty2 = Ty1->getPointerElementType();
-  return (Ty1 == FPType || Ty2 == FPType) ? FPType : IntType;
+    Ty2 = Ty2->getPointerElementType();
+  auto ElTy = commonScalarType(Ty1->getScalarType(), Ty2->getScalarType());
+  if (!ElTy)
+    return nullptr;
+
+  auto VTy1 = dyn_cast<FixedVectorType>(Ty1), VTy2 = dyn_cast<FixedVectorType>(Ty2);
+  if (VTy1 && VTy2 && VTy1->getNumElements() != VTy2->getNumElements())
+    return nullptr;
+  if (VTy1 || VTy2)
+    return FixedVectorType::get(ElTy, (VTy1 ? VTy1 : VTy2)->getNumElements());
+  return ElTy;
+}
+
+/* Int and Double cells never overlap, TBAA lets alias analysis see that. */
+static MDNode *getTBAATag(Type *Ty)
+{
+  /* Whole records are accessed untyped, their fields are tagged. */
+  if (Ty->isStructTy())
+    return nullptr;
+  MDBuilder MDB(*TheContext);
+  auto Root = MDB.createTBAARoot("BoboLang TBAA");
+  auto ScalarTy = Ty->getScalarType();
+  auto Name = ScalarTy->isDoubleTy()      ? "double"
+              : ScalarTy->isFloatTy()     ? "float"
+              : ScalarTy->isIntegerTy(32) ? "int32"
+                                          : "int";
+  auto Scalar = MDB.createTBAAScalarTypeNode(Name, Root);
+  return MDB.createTBAAStructTagNode(Scalar, Scalar, 0);
+}
+
+static LoadInst *createLoad(Value *Ptr)
+{
+  auto ElType = Ptr->getType()->getPointerElementType();
+  auto Load = Builder->CreateLoad(ElType, Ptr);
+  Load->setMetadata(LLVMContext::MD_tbaa, getTBAATag(ElType));
+  return Load;
+}
+
+static StoreInst *createStore(Value *V, Value *Ptr)
+{
+  auto Store = Builder->CreateStore(V, Ptr);
+  Store->setMetadata(LLVMContext::MD_tbaa, getTBAATag(V->getType()));
+  return Store;
 }
 
 static Value *getPointerElement(Value *Ptr)
 {
-  auto Type = Ptr->getType();
-  if (Type->isPointerTy())
-  {
-    auto ElType = Type->getPointerElementType();
-    return Builder->CreateLoad(ElType, Ptr);
-  }
+  if (isArray(Ptr))
+    return LogErrorV("array used as a value");
+  if (Ptr->getType()->isPointerTy())
+    return createLoad(Ptr);
   return Ptr;
 }
 
@@ -96,12 +406,40 @@ static Value *castValue(Value *V, Type *DestTy)
   }
 
   V = getPointerElement(V);
-  if (Ty != DestTy)
+  if (!V)
+    return nullptr;
+  Ty = V->getType();
+  if (Ty == DestTy)
+    return V;
+  if (Ty->isStructTy() || DestTy->isStructTy())
+    return LogErrorV("cannot convert a record");
+
+  if (auto VTy = dyn_cast<FixedVectorType>(DestTy))
   {
-    auto castOp = DestTy->isFloatingPointTy() ? Instruction::CastOps::UIToFP : Instruction::CastOps::FPToUI;
-    return Builder->CreateCast(castOp, V, DestTy);
+    if (!Ty->isVectorTy())
+    {
+      V = castValue(V, VTy->getElementType());
+      return V ? Builder->CreateVectorSplat(VTy->getNumElements(), V) : nullptr;
+    }
+    if (cast<FixedVectorType>(Ty)->getNumElements() != VTy->getNumElements())
+      return LogErrorV("cannot cast vector to different length");
   }
-  return V;
+  else if (Ty->isVectorTy())
+    return LogErrorV("cannot cast vector to scalar");
+
+  /* Numbers are signed, comparison results are 0 or 1. */
+  bool SrcSigned = !Ty->getScalarType()->isIntegerTy(1);
+  auto castOp = CastInst::getCastOpcode(V, SrcSigned, DestTy, true);
+  return Builder->CreateCast(castOp, V, DestTy);
+}
+
+/* malloc/free work on generic pointers, heap cells live in their own address space. */
+static void createFree(Value *Ptr)
+{
+  auto BB = Builder->GetInsertBlock();
+  auto ElTy = Ptr->getType()->getPointerElementType();
+  auto Generic = Builder->CreateAddrSpaceCast(Ptr, ElTy->getPointerTo());
+  BB->getInstList().push_back(CallInst::CreateFree(Generic, BB));
 }
 
 Value *NumberDoubleExprAST::codegen()
@@ -121,17 +459,122 @@ Value *VariableExprAST::codegen()
   return LogErrorV("Unknown variable name");
 }
 
+/* Address of Name[Index], an inbounds GEP the vectorizer can widen. */
+static Value *codegenIndex(ExprAST &Index)
+{
+  auto Idx = Index.codegen();
+  return Idx ? castValue(Idx, IntType) : nullptr;
+}
+
+static Value *codegenElementAddress(Value *Ptr, ExprAST &Index)
+{
+  if (!isArray(Ptr))
+    return LogErrorV("subscripted value is not an array");
+
+  auto Idx = codegenIndex(Index);
+  if (!Idx)
+    return nullptr;
+  auto ArrTy = Ptr->getType()->getPointerElementType();
+  return Builder->CreateInBoundsGEP(ArrTy, Ptr, {Builder->getInt64(0), Idx});
+}
+
+/* Address of p.f or ps[i].f. An aos array indexes the record, then the
+   field; a soa array picks the field's column, then indexes it. */
+static Value *codegenFieldAddress(Value *Ptr, ExprAST *Index, const std::string &Field)
+{
+  auto Ty = Ptr->getType()->getPointerElementType();
+  if (Index && isArray(Ptr))
+    Ty = Ty->getArrayElementType();
+  auto STy = dyn_cast<StructType>(Ty);
+  auto S = STy ? getStructOf(STy) : nullptr;
+  if (!S)
+    return LogErrorV("field of a value that is not a record");
+  int FieldNo = S->getFieldIndex(Field);
+  if (FieldNo < 0)
+    return LogErrorV("no such field");
+
+  bool IsColumns = isColumns(STy);
+  if (!Index)
+  {
+    if (isArray(Ptr) || IsColumns)
+      return LogErrorV("array of records used without index");
+    return Builder->CreateStructGEP(STy, Ptr, FieldNo);
+  }
+  if (!isArray(Ptr) && !IsColumns)
+    return LogErrorV("subscripted value is not an array");
+
+  auto Idx = codegenIndex(*Index);
+  if (!Idx)
+    return nullptr;
+  if (IsColumns)
+  {
+    auto Column = Builder->CreateExtractValue(createLoad(Ptr), FieldNo);
+    auto ArrTy = Column->getType()->getPointerElementType();
+    return Builder->CreateInBoundsGEP(ArrTy, Column, {Builder->getInt64(0), Idx});
+  }
+  auto ArrTy = Ptr->getType()->getPointerElementType();
+  return Builder->CreateInBoundsGEP(ArrTy, Ptr, {Builder->getInt64(0), Idx, Builder->getInt32(FieldNo)});
+}
+
+Value *FieldExprAST::codegen()
+{
+  auto Ptr = findVar(Name);
+  if (!Ptr)
+    return LogErrorV("Unknown variable name");
+
+  auto Addr = codegenFieldAddress(Ptr, Index.get(), Field);
+  if (!Addr)
+    return nullptr;
+  return createLoad(Addr);
+}
+
+/* a[i] loads an array element, v[i] extracts a vector lane. */
+Value *IndexExprAST::codegen()
+{
+  auto Ptr = findVar(Name);
+  if (!Ptr)
+    return LogErrorV("Unknown variable name");
+
+  if (isVectorSlot(Ptr))
+  {
+    auto Idx = codegenIndex(*Index);
+    return Idx ? Builder->CreateExtractElement(createLoad(Ptr), Idx) : nullptr;
+  }
+
+  auto Addr = codegenElementAddress(Ptr, *Index);
+  if (!Addr)
+    return nullptr;
+  return createLoad(Addr);
+}
+
+/* Walk down the left operands of a chain and lower it bottom up, in the
+   order recursion would. */
 Value *BinaryExprAST::codegen()
 {
-  auto L = LHS->codegen(), R = RHS->codegen();
+  std::vector<BinaryExprAST *> Chain{this};
+  while (Chain.back()->LHS->getKind() == ast_binary)
+    Chain.push_back(static_cast<BinaryExprAST *>(Chain.back()->LHS.get()));
+
+  auto L = Chain.back()->LHS->codegen();
+  for (auto It = Chain.rbegin(); It != Chain.rend() && L; ++It)
+    L = (*It)->codegenOp(L, (*It)->RHS->codegen());
+  return L;
+}
+
+Value *BinaryExprAST::codegenOp(Value *L, Value *R)
+{
   if (!L || !R)
     return nullptr;
 
   auto Ty = lowestCommonType(L->getType(), R->getType());
+  if (!Ty)
+    return LogErrorV("incompatible operand types");
   L = castValue(L, Ty);
   R = castValue(R, Ty);
+  if (!L || !R)
+    return nullptr;
 
-  if (Ty == FPType)
+  if (Ty->isFPOrFPVectorTy())
   {
     switch (Op)
     {
@@ -150,87 +593,249 @@ Value *BinaryExprAST::codegen()
     switch (Op)
     {
     case '+':
-      return Builder->CreateAdd(L, R);
+      return Builder->CreateAdd(L, R, "", false, NumericMode);
     case '-':
-      return Builder->CreateSub(L, R);
+      return Builder->CreateSub(L, R, "", false, NumericMode);
     case '*':
-      return Builder->CreateMul(L, R);
+      return Builder->CreateMul(L, R, "", false, NumericMode);
     case '<':
-      return Builder->CreateICmpULT(L, R);
+      return Builder->CreateICmpSLT(L, R);
     }
   }
   return LogErrorV("binary op not sopport");
 }
 
-Value *CallExprAST::codegen()
+bool CallExprAST::codegenArgs(Function *CalleeF, std::vector<Value *> &ArgsValue)
 {
-  auto CalleeF = getFunction(Callee);
-  if (!CalleeF)
-    return LogErrorV("Unknown function");
-
   if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect number of arguments");
+  {
+    LogErrorV("Incorrect number of arguments");
+    return false;
+  }
 
-  std::vector<Value *> ArgsValue;
   for (int i = 0, e = Args.size(); i < e; i++)
   {
     auto ArgTy = CalleeF->getArg(i)->getType();
     auto ArgVal = Args[i]->codegen();
-    ArgsValue.push_back(castValue(ArgVal, ArgTy));
-    if (!ArgsValue.back())
-      return nullptr;
+    if (!ArgVal || !(ArgVal = castValue(ArgVal, ArgTy)))
+      return false;
+    ArgsValue.push_back(ArgVal);
   }
+  return true;
+}
+
+/* extern double sqrt(double x); and friends map onto LLVM intrinsics, which
+   the optimizer folds and the vectorizer widens through the vector library. */
+static Intrinsic::ID getMathIntrinsic(Function *F)
+{
+  if (!NumericMode || !F->isDeclaration())
+    return Intrinsic::not_intrinsic;
+
+  /* sqrtf and friends are the float versions. */
+  auto Name = F->getName();
+  auto Ty = F->getReturnType();
+  if (Ty->isFloatTy() && Name.endswith("f"))
+    Name = Name.drop_back();
+  else if (!Ty->isDoubleTy())
+    return Intrinsic::not_intrinsic;
+
+  auto ID = StringSwitch<Intrinsic::ID>(Name)
+                .Case("sqrt", Intrinsic::sqrt)
+                .Case("fabs", Intrinsic::fabs)
+                .Case("fma", Intrinsic::fma)
+                .Case("exp", Intrinsic::exp)
+                .Case("log", Intrinsic::log)
+                .Default(Intrinsic::not_intrinsic);
 
-  auto Call = Builder->CreateCall(CalleeF, ArgsValue);
+  unsigned NumArgs = ID == Intrinsic::fma ? 3 : 1;
+  if (F->arg_size() != NumArgs)
+    return Intrinsic::not_intrinsic;
+  for (auto &Arg : F->args())
+    if (Arg.getType() != Ty)
+      return Intrinsic::not_intrinsic;
+  return ID;
+}
+
+static CallInst *createCall(Function *CalleeF, std::vector<Value *> &ArgsValue)
+{
+  auto ID = getMathIntrinsic(CalleeF);
+  if (ID != Intrinsic::not_intrinsic)
+    return Builder->CreateIntrinsic(ID, {CalleeF->getReturnType()}, ArgsValue);
+  return Builder->CreateCall(CalleeF, ArgsValue);
+}
+
+enum ReductionKind
+{
+  reduce_none = 0,
+  reduce_add,
+  reduce_mul,
+  reduce_min,
+  reduce_max,
+};
+
+/* Horizontal reductions, only used when no function of that name exists. */
+static ReductionKind getReductionKind(StringRef Name)
+{
+  return StringSwitch<ReductionKind>(Name)
+      .Case("reduceadd", reduce_add)
+      .Case("reducemul", reduce_mul)
+      .Case("reducemin", reduce_min)
+      .Case("reducemax", reduce_max)
+      .Default(reduce_none);
+}
+
+Value *CallExprAST::codegenReduction(int Kind)
+{
+  if (Args.size() != 1)
+    return LogErrorV("Incorrect number of arguments");
+  auto V = Args[0]->codegen();
+  if (!V || !(V = getPointerElement(V)))
+    return nullptr;
+  if (!V->getType()->isVectorTy())
+    return LogErrorV("reduction of a non-vector value");
+
+  auto ElTy = V->getType()->getScalarType();
+  if (ElTy->isFloatingPointTy())
+  {
+    switch (Kind)
+    {
+    case reduce_add:
+      return Builder->CreateFAddReduce(ConstantFP::getNegativeZero(ElTy), V);
+    case reduce_mul:
+      return Builder->CreateFMulReduce(ConstantFP::get(ElTy, 1.0), V);
+    case reduce_min:
+      return Builder->CreateFPMinReduce(V);
+    case reduce_max:
+      return Builder->CreateFPMaxReduce(V);
+    }
+  }
+  switch (Kind)
+  {
+  case reduce_add:
+    return Builder->CreateAddReduce(V);
+  case reduce_mul:
+    return Builder->CreateMulReduce(V);
+  case reduce_min:
+    return Builder->CreateIntMinReduce(V, true);
+  case reduce_max:
+    return Builder->CreateIntMaxReduce(V, true);
+  }
+  return LogErrorV("unknown reduction");
+}
+
+Value *CallExprAST::codegen()
+{
+  auto CalleeF = getFunction(Callee);
+  if (!CalleeF)
+  {
+    if (auto Kind = getReductionKind(Callee))
+      return codegenReduction(Kind);
+    return LogErrorV("Unknown function");
+  }
+
+  std::vector<Value *> ArgsValue;
+  if (!codegenArgs(CalleeF, ArgsValue))
+    return nullptr;
+
+  auto Call = createCall(CalleeF, ArgsValue);
   if (CalleeF->getReturnType()->isPointerTy())
   {
-    auto &Scope = HeapValuesScope.front();
-    auto sz = Scope->size();
+    auto sz = getBlockHeap().size();
     std::string Unnamed = std::string("_").append(itostr(sz));
-    (*Scope)[Unnamed] = Call;
+    addHeapValue(Unnamed, Call);
   }
 
   return Call;
 }
 
+/* Keep every stack slot in the entry block so loops never grow the stack. */
+static AllocaInst *createEntryBlockAlloca(Type *Ty, const std::string &Name)
+{
+  auto &Entry = Builder->GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> TmpB(&Entry, Entry.begin());
+  return TmpB.CreateAlloca(Ty, 0, Name);
+}
+
+/* int a[n]: one contiguous block of n elements, freed like a heap cell. */
+static Instruction *createArray(Type *ElTy, Value *Size, const std::string &Name)
+{
+  auto BB = Builder->GetInsertBlock();
+  auto Malloc = CallInst::CreateMalloc(BB, IntType, ArrayType::get(ElTy, 0),
+                                       ConstantExpr::getSizeOf(ElTy), Size, nullptr);
+  BB->getInstList().push_back(Malloc);
+  return cast<Instruction>(Builder->CreateAddrSpaceCast(Malloc, getArrayPtrType(ElTy), Name));
+}
+
+/* soa T a[n]: one array per field, their pointers kept in a stack slot.
+   The columns are freed under "a.field", which no variable can be named. */
+static Instruction *createColumns(StructAST &S, Value *Size, const std::string &Name)
+{
+  auto ColumnsTy = S.getColumnsType();
+  if (!ColumnsTy)
+    return nullptr;
+
+  Value *Columns = UndefValue::get(ColumnsTy);
+  for (unsigned i = 0, e = ColumnsTy->getNumElements(); i < e; i++)
+  {
+    auto ElTy = ColumnsTy->getElementType(i)->getPointerElementType()->getArrayElementType();
+    auto ColumnName = Name + "." + S.getFields()[i];
+    auto Column = createArray(ElTy, Size, ColumnName);
+    addHeapValue(ColumnName, Column);
+    Columns = Builder->CreateInsertValue(Columns, Column, i);
+  }
+  auto Slot = createEntryBlockAlloca(ColumnsTy, Name);
+  createStore(Columns, Slot);
+  return Slot;
+}
+
 Value *DeclStmtAST::codegen()
 {
+  auto Ty = getValueType(ValType);
+  if (!Ty)
+    return LogErrorV("unknown type");
+
   Instruction *Last;
-  for (auto &Name : Names)
+  for (size_t i = 0, e = Names.size(); i < e; i++)
   {
-    Type *Ty, *PtrTy;
-    switch (ValType)
+    auto &Name = Names[i];
+    if (Sizes[i])
     {
-    case type_int:
-      Ty = IntType;
-      goto DeclStackVar;
-    case type_double:
-      Ty = FPType;
-    DeclStackVar:
-      Last = Builder->CreateAlloca(Ty, 0, Name);
-      if (!addVar(Name, Last))
+      if (!Ty->isIntegerTy() && !Ty->isFloatingPointTy() && !Ty->isStructTy())
+        return LogErrorV("only arrays of int, double, int32, float and records are supported");
+      auto Size = Sizes[i]->codegen();
+      if (!Size || !(Size = castValue(Size, IntType)))
+        return nullptr;
+      auto S = getStruct(ValType);
+      if (S && S->isSoA())
+      {
+        if (!(Last = createColumns(*S, Size, Name)))
+          return nullptr;
+        if (!addVar(Name, Last))
+          return LogErrorV("redeclare var");
+        continue;
+      }
+      Last = createArray(Ty, Size, Name);
+      if (!addVar(Name, Last, true))
         return LogErrorV("redeclare var");
-      break;
-
-    case type_intptr:
-      Ty = IntType;
-      PtrTy = IntPtrType;
-      goto DeclHeapVar;
-    case type_doubleptr:
-      Ty = FPType;
-      PtrTy = FPPtrType;
-    DeclHeapVar:
+    }
+    else if (Ty->isPointerTy())
+    {
+      /* Int, Double, Int32 and Float are single heap cells. */
+      auto ElTy = Ty->getPointerElementType();
       Last = CallInst::CreateMalloc(Builder->GetInsertBlock(),
-                                    PtrTy,
-                                    Ty,
-                                    ConstantExpr::getSizeOf(Ty), nullptr, nullptr);
+                                    IntType,
+                                    ElTy,
+                                    ConstantExpr::getSizeOf(ElTy), nullptr, nullptr);
       Builder->GetInsertBlock()->getInstList().push_back(Last);
+      Last = cast<Instruction>(Builder->CreateAddrSpaceCast(Last, Ty, Name));
       if (!addVar(Name, Last, true))
         return LogErrorV("redeclare var");
-      break;
-
-    default:
-      return LogErrorV("unknown type");
+    }
+    else
+    {
+      Last = createEntryBlockAlloca(Ty, Name);
+      if (!addVar(Name, Last))
+        return LogErrorV("redeclare var");
     }
   }
   return Last;
@@ -241,16 +846,145 @@ Value *SimpStmtAST::codegen()
   auto Ptr = findVar(Name);
   if (!Ptr)
     return LogErrorV("undeclared var");
+  if (Outline && Outline->ReadOnly.count(Ptr))
+    return LogErrorV("variables around a parallel for are read-only in it, use a reduction");
+
+  if (Index && isVectorSlot(Ptr))
+  {
+    auto Idx = codegenIndex(*Index);
+    if (!Idx)
+      return nullptr;
+    Value *V = Expr->codegen();
+    auto ElTy = cast<VectorType>(Ptr->getType()->getPointerElementType())->getElementType();
+    if (!V || !(V = castValue(V, ElTy)))
+      return nullptr;
+    createStore(Builder->CreateInsertElement(createLoad(Ptr), V, Idx), Ptr);
+    return V;
+  }
+
+  if (!Field.empty())
+  {
+    if (!(Ptr = codegenFieldAddress(Ptr, Index.get(), Field)))
+      return nullptr;
+  }
+  else if (Index && !(Ptr = codegenElementAddress(Ptr, *Index)))
+    return nullptr;
+  if (isArray(Ptr) || isColumns(Ptr->getType()->getPointerElementType()))
+    return LogErrorV("cannot assign to an array");
   Value *V = Expr->codegen();
-  V = castValue(V, Ptr->getType()->getPointerElementType());
-  Builder->CreateStore(V, Ptr);
+  if (!V || !(V = castValue(V, Ptr->getType()->getPointerElementType())))
+    return nullptr;
+  createStore(V, Ptr);
   return V;
 }
 
+/* Lowers Root and the blocks, ifs and whiles nested in it off a work
+   stack, so nesting depth is only bounded by the heap. A frame is a block
+   and the index of its next statement, or an if or while and how many of
+   its blocks were started. Other statements are lowered right away, a
+   parallel for lowers its body with a walk of its own. */
+static Value *codegenNested(StmtAST *Root)
+{
+  struct Frame
+  {
+    StmtAST *Stmt;
+    size_t Step;
+    BasicBlock *BBs[2];
+  };
+  std::vector<Frame> Stack;
+  /* Value of the statement lowered last, a block yields the one of its
+     last statement. */
+  Value *Last = nullptr;
+  StmtAST *Next = Root;
+  while (true)
+  {
+    if (Next)
+    {
+      Frame F{Next, 0, {nullptr, nullptr}};
+      switch (Next->getKind())
+      {
+      case ast_block:
+        static_cast<BlockAST *>(Next)->codegenEnter();
+        Last = Builder->GetInsertBlock();
+        break;
+      case ast_ifelse:
+        if (!static_cast<IfElseStmtAST *>(Next)->codegenCond(F.BBs[0], F.BBs[1]))
+          return nullptr;
+        break;
+      case ast_while:
+        if (!static_cast<WhileStmtAST *>(Next)->codegenCond(F.BBs[0], F.BBs[1]))
+          return nullptr;
+        break;
+      default:
+        if (!(Last = Next->codegen()))
+          return nullptr;
+        F.Stmt = nullptr;
+        break;
+      }
+      if (F.Stmt)
+        Stack.push_back(F);
+      Next = nullptr;
+    }
+    if (Stack.empty())
+      return Last;
+
+    auto &F = Stack.back();
+    auto Step = F.Step++;
+    switch (F.Stmt->getKind())
+    {
+    case ast_block:
+    {
+      auto B = static_cast<BlockAST *>(F.Stmt);
+      if (Step < B->getStmts().size())
+        Next = B->getStmts()[Step].get();
+      else
+      {
+        B->codegenExit();
+        Stack.pop_back();
+      }
+      break;
+    }
+    case ast_ifelse:
+    {
+      auto S = static_cast<IfElseStmtAST *>(F.Stmt);
+      if (Step == 0)
+        Next = S->getThen();
+      else if (Step == 1)
+      {
+        S->codegenElse(F.BBs[0], F.BBs[1]);
+        Next = S->getElse();
+      }
+      else
+      {
+        Last = S->codegenMerge(F.BBs[1]);
+        Stack.pop_back();
+      }
+      break;
+    }
+    default:
+    {
+      auto S = static_cast<WhileStmtAST *>(F.Stmt);
+      if (Step == 0)
+        Next = S->getLoop();
+      else
+      {
+        Last = S->codegenBackEdge(F.BBs[0], F.BBs[1]);
+        Stack.pop_back();
+      }
+      break;
+    }
+    }
+  }
+}
+
 Value *BlockAST::codegen()
 {
-  NamedValuesScope.push_front(std::make_unique<std::map<std::string, Value *>>());
-  HeapValuesScope.push_front(std::make_unique<std::map<std::string, Value *>>());
+  return codegenNested(this);
+}
+
+void BlockAST::codegenEnter()
+{
+  Scopes.Declared.emplace_back();
   if (IsFunctionBlock)
   {
     auto TheFunction = Builder->GetInsertBlock()->getParent();
@@ -263,54 +997,197 @@ Value *BlockAST::codegen()
       {
         auto Ptr = Builder->CreateAlloca(ArgTy, 0, Arg.getName());
         addVar(std::string(Arg.getName()), Ptr);
-        Builder->CreateStore(&Arg, Ptr);
+        createStore(&Arg, Ptr);
       }
     }
+    auto &Entry = *Builder->GetInsertBlock();
+    ArgsSetupEnd = Entry.empty() ? nullptr : &Entry.back();
     IsFunctionBlock = false;
   }
+}
 
-  Value *Last;
-  for (auto &Stmt : Stmts)
+/* --mem-report: sizes of the symbol tables, with the scopes of the function
+   a parallel for body is outlined from. */
+static void noteScopes()
+{
+  SymbolTableUsage Now;
+  auto AddScopes = [&](const ScopeStack &S)
   {
-    if (!(Last = Stmt->codegen()))
-      return nullptr;
-  }
+    Now.Scopes += S.Declared.size();
+    Now.Variables += S.NumVars;
+    /* A hash table entry per name ever declared, with its bindings. */
+    Now.VariableBytes += S.Vars.getNumBuckets() * 2 * sizeof(void *) + S.NumVars * sizeof(Binding);
+    for (auto &Stack : S.Vars)
+      Now.VariableBytes += sizeof(BindingStack) + Stack.getKeyLength() + 1;
+    Now.HeapValues += S.NumHeapValues;
+  };
+  AddScopes(Scopes);
+  if (Outline)
+    AddScopes(Outline->Outer);
+  Now.FunctionProtos = FunctionProtos.size();
+  Now.StructDecls = StructDecls.size();
+  noteSymbolTables(Now);
+}
+
+void BlockAST::codegenExit()
+{
+  if (MemReport)
+    noteScopes();
+  unsigned Depth = Scopes.Declared.size();
+  for (auto Stack : Scopes.Declared.back())
+    Stack->second.pop_back();
+  Scopes.NumVars -= Scopes.Declared.back().size();
+  Scopes.Declared.pop_back();
 
-  NamedValuesScope.pop_front();
+  if (Scopes.Heap.empty() || Scopes.Heap.back().Depth != Depth)
+    return;
   auto BB = Builder->GetInsertBlock();
-  if (!isa<ReturnInst>(BB->getInstList().back()))
+  for (auto &Var : Scopes.Heap.back().Cells)
   {
-    for (auto &Var : *HeapValuesScope.front())
-    {
-      auto GC = CallInst::CreateFree(Var.second, BB);
-      BB->getInstList().push_back(GC);
-    }
+    if (!BB->getTerminator())
+      createFree(Var.second);
+    Scopes.HeapRefs[Var.second]--;
   }
-  HeapValuesScope.pop_front();
-  return Last;
+  Scopes.NumHeapValues -= Scopes.Heap.back().Cells.size();
+  Scopes.Heap.pop_back();
 }
 
-Value *ReturnStmtAST::codegen()
+/* Innermost block first, as the blocks would close. */
+static void freeHeapValues(Value *Keep = nullptr)
 {
-  auto RetVal = Expr->codegen();
-  auto BB = Builder->GetInsertBlock();
-  auto RetTy = BB->getParent()->getReturnType();
-  RetVal = castValue(RetVal, BB->getParent()->getReturnType());
-  auto &Scope = HeapValuesScope.front();
-  for (auto &Pair : *Scope)
+  for (auto Scope = Scopes.Heap.rbegin(); Scope != Scopes.Heap.rend(); ++Scope)
+    for (auto &Pair : Scope->Cells)
+      if (Pair.second != Keep)
+        createFree(Pair.second);
+}
+
+static bool isHeapValue(Value *V)
+{
+  return Scopes.HeapRefs.lookup(V) != 0;
+}
+
+/* Turn a self tail call into stores to the argument slots and a jump back
+   to the code right after them. Pointer arguments have no slot to store to,
+   soa columns could be freed before the next iteration reads them. */
+static Value *codegenTailRecursion(Function *TheFunction, std::vector<Value *> &ArgsValue)
+{
+  for (auto &Arg : TheFunction->args())
+    if (Arg.getType()->isPointerTy() || isColumns(Arg.getType()))
+      return nullptr;
+
+  if (!TailRecurseBB)
   {
-    if (RetTy->isPointerTy() && Pair.second == RetVal)
-      continue;
+    /* Split the entry block after the argument slots are initialized and
+       the entry is counted. */
+    auto Entry = &TheFunction->getEntryBlock();
+    auto SplitPt = Entry->begin();
+    if (ArgsSetupEnd)
+      SplitPt = std::next(ArgsSetupEnd->getIterator());
     else
-      BB->getInstList().push_back(CallInst::CreateFree(Pair.second, BB));
+      while (SplitPt != Entry->end() && isa<AllocaInst>(*SplitPt))
+        ++SplitPt;
+
+    TailRecurseBB = BasicBlock::Create(*TheContext, "tailrecurse", TheFunction, Entry->getNextNode());
+    TailRecurseBB->getInstList().splice(TailRecurseBB->end(), Entry->getInstList(), SplitPt, Entry->end());
+    BranchInst::Create(TailRecurseBB, Entry);
+    if (Builder->GetInsertBlock() == Entry)
+      Builder->SetInsertPoint(TailRecurseBB);
+  }
+
+  /* The slots are the bindings of the function block. */
+  for (auto &Arg : TheFunction->args())
+    createStore(ArgsValue[Arg.getArgNo()], Scopes.Vars[Arg.getName()].front().V);
+  freeHeapValues();
+  return Builder->CreateBr(TailRecurseBB);
+}
+
+/* return f(...): evaluate the arguments, release the heap cells, then call
+   in tail position. Heap cells passed as arguments must outlive the call,
+   so such calls stay ordinary calls. */
+static Value *codegenTailCall(CallExprAST &Call)
+{
+  auto TheFunction = Builder->GetInsertBlock()->getParent();
+  auto CalleeF = getFunction(Call.getCallee());
+  if (!CalleeF)
+    return LogErrorV("Unknown function");
+
+  std::vector<Value *> ArgsValue;
+  if (!Call.codegenArgs(CalleeF, ArgsValue))
+    return nullptr;
+
+  auto RetTy = TheFunction->getReturnType();
+  bool CanTail = true;
+  for (auto V : ArgsValue)
+    CanTail &= !isHeapValue(V) && !isColumns(V->getType());
+  /* A returned heap cell that is only read still has to be freed here. */
+  CanTail &= !CalleeF->getReturnType()->isPointerTy() || RetTy->isPointerTy();
+
+  if (!CanTail)
+  {
+    auto CallV = createCall(CalleeF, ArgsValue);
+    auto RetVal = castValue(CallV, RetTy);
+    if (!RetVal)
+      return nullptr;
+    freeHeapValues(RetVal);
+    if (CallV->getType()->isPointerTy() && RetVal != CallV)
+      createFree(CallV);
+    return Builder->CreateRet(RetVal);
   }
+
+  if (CalleeF == TheFunction && TailRecursionToLoop)
+    if (auto Br = codegenTailRecursion(TheFunction, ArgsValue))
+      return Br;
+
+  freeHeapValues();
+  auto CallV = createCall(CalleeF, ArgsValue);
+  auto RetVal = castValue(CallV, RetTy);
+  if (!RetVal)
+    return nullptr;
+
+  /* Intrinsics are lowered inline, there is no call to keep in tail position. */
+  if (isa<IntrinsicInst>(CallV))
+    return Builder->CreateRet(RetVal);
+
+  if (RetVal == CallV &&
+      CalleeF->getFunctionType() == TheFunction->getFunctionType() &&
+      CalleeF->getCallingConv() == TheFunction->getCallingConv())
+    CallV->setTailCallKind(CallInst::TCK_MustTail);
+  else
+    CallV->setTailCallKind(CallInst::TCK_Tail);
+  return Builder->CreateRet(RetVal);
+}
+
+Value *ReturnStmtAST::codegen()
+{
+  if (Outline)
+    return LogErrorV("return inside parallel for");
+
+  /* Reductions are no calls, they take the expression path. */
+  auto Call = Expr->getKind() == ast_call ? static_cast<CallExprAST *>(Expr.get()) : nullptr;
+  if (Call && (getFunction(Call->getCallee()) || !getReductionKind(Call->getCallee())))
+    return codegenTailCall(*Call);
+
+  auto RetVal = Expr->codegen();
+  if (!RetVal)
+    return nullptr;
+  auto RetTy = Builder->GetInsertBlock()->getParent()->getReturnType();
+  RetVal = castValue(RetVal, RetTy);
+  if (!RetVal)
+    return nullptr;
+  freeHeapValues(RetVal);
   return Builder->CreateRet(RetVal);
 }
 
 static Value *getBoolValue(Value *Val)
 {
+  if (!(Val = getPointerElement(Val)))
+    return nullptr;
+  if (Val->getType()->isVectorTy())
+    return LogErrorV("vector used as a condition");
   auto Type = Val->getType();
-  if (Type->isFloatingPointTy())
+  if (Type->isIntegerTy(1))
+    return Val;
+  else if (Type->isFloatingPointTy())
     return Builder->CreateCmp(CmpInst::Predicate::FCMP_ONE, Val, ConstantFP::get(Type, 0.0));
   else if (Type->isIntegerTy())
     return Builder->CreateCmp(CmpInst::Predicate::ICMP_NE, Val, ConstantInt::get(Type, 0));
@@ -318,108 +1195,343 @@ static Value *getBoolValue(Value *Val)
 }
 
 Value *IfElseStmtAST::codegen()
+{
+  return codegenNested(this);
+}
+
+bool IfElseStmtAST::codegenCond(BasicBlock *&ElseBB, BasicBlock *&MergeBB)
 {
   Value *CondVal = Cond->codegen();
   if (!CondVal)
-    return nullptr;
-  CondVal = getBoolValue(CondVal);
+    return false;
+  if (!(CondVal = getBoolValue(CondVal)))
+    return false;
 
   auto TheFunction = Builder->GetInsertBlock()->getParent();
 
-  auto ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction),
-       ElseBB = BasicBlock::Create(*TheContext, "else", TheFunction),
-       MergeBB = BasicBlock::Create(*TheContext, "ifcont", TheFunction);
+  auto ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+  ElseBB = BasicBlock::Create(*TheContext, "else", TheFunction);
+  MergeBB = BasicBlock::Create(*TheContext, "ifcont", TheFunction);
 
-  Builder->CreateCondBr(CondVal, ThenBB, ElseBB);
+  /* The weights __builtin_expect gives, a profile overrides them. */
+  auto Br = Builder->CreateCondBr(CondVal, ThenBB, ElseBB);
+  if (Likely)
+    Br->setMetadata(LLVMContext::MD_prof, MDBuilder(*TheContext).createBranchWeights(Likely > 0 ? 2000 : 1,
+                                                                                     Likely > 0 ? 1 : 2000));
+  profileCondBr(Br);
 
   Builder->SetInsertPoint(ThenBB);
-  auto IfVal = Then->codegen();
-  if (!IfVal)
-    return nullptr;
-  Builder->CreateBr(MergeBB);
-  ThenBB = Builder->GetInsertBlock();
+  return true;
+}
 
+void IfElseStmtAST::codegenElse(BasicBlock *ElseBB, BasicBlock *MergeBB)
+{
+  if (!Builder->GetInsertBlock()->getTerminator())
+    Builder->CreateBr(MergeBB);
   Builder->SetInsertPoint(ElseBB);
-  auto ElseVal = Else->codegen();
-  if (!ElseVal)
-    return nullptr;
-  Builder->CreateBr(MergeBB);
-  ElseBB = Builder->GetInsertBlock();
+}
 
+Value *IfElseStmtAST::codegenMerge(BasicBlock *MergeBB)
+{
+  if (!Builder->GetInsertBlock()->getTerminator())
+    Builder->CreateBr(MergeBB);
   Builder->SetInsertPoint(MergeBB);
   return MergeBB;
 }
 
+/* llvm.loop metadata for the hints after a while condition. */
+static MDNode *getLoopID(const std::vector<std::pair<std::string, int>> &Hints)
+{
+  auto &Ctx = *TheContext;
+  auto Flag = [&](const char *Name, Metadata *Arg = nullptr)
+  {
+    SmallVector<Metadata *, 2> Ops{MDString::get(Ctx, Name)};
+    if (Arg)
+      Ops.push_back(Arg);
+    return MDNode::get(Ctx, Ops);
+  };
+  auto Count = [&](int N)
+  { return ConstantAsMetadata::get(Builder->getInt32(N)); };
+  auto True = ConstantAsMetadata::get(Builder->getTrue());
+  auto False = ConstantAsMetadata::get(Builder->getFalse());
+
+  SmallVector<Metadata *, 4> Ops{nullptr};
+  for (auto &Hint : Hints)
+  {
+    auto N = Hint.second;
+    if (Hint.first == "unroll")
+      Ops.push_back(N == 0   ? Flag("llvm.loop.unroll.enable")
+                    : N == 1 ? Flag("llvm.loop.unroll.disable")
+                             : Flag("llvm.loop.unroll.count", Count(N)));
+    else if (Hint.first == "vectorize")
+    {
+      Ops.push_back(Flag("llvm.loop.vectorize.enable", N == 1 ? False : True));
+      if (N > 1)
+        Ops.push_back(Flag("llvm.loop.vectorize.width", Count(N)));
+    }
+    else if (Hint.first == "interleave")
+      Ops.push_back(Flag("llvm.loop.interleave.count", Count(N)));
+    else if (Hint.first == "distribute")
+      Ops.push_back(Flag("llvm.loop.distribute.enable", True));
+  }
+
+  auto LoopID = MDNode::getDistinct(Ctx, Ops);
+  LoopID->replaceOperandWith(0, LoopID);
+  return LoopID;
+}
+
 Value *WhileStmtAST::codegen()
+{
+  return codegenNested(this);
+}
+
+bool WhileStmtAST::codegenCond(BasicBlock *&CondBB, BasicBlock *&ContBB)
 {
   auto TheFunction = Builder->GetInsertBlock()->getParent();
 
-  auto CondBB = BasicBlock::Create(*TheContext, "while", TheFunction),
-       LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction),
-       ContBB = BasicBlock::Create(*TheContext, "cont", TheFunction);
+  CondBB = BasicBlock::Create(*TheContext, "while", TheFunction);
+  auto LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+  ContBB = BasicBlock::Create(*TheContext, "cont", TheFunction);
 
   Builder->CreateBr(CondBB);
 
   Builder->SetInsertPoint(CondBB);
   auto CondVal = Cond->codegen();
   if (!CondVal)
-    return nullptr;
-  CondVal = getBoolValue(CondVal);
-  Builder->CreateCondBr(CondVal, LoopBB, ContBB);
+    return false;
+  if (!(CondVal = getBoolValue(CondVal)))
+    return false;
+  profileCondBr(Builder->CreateCondBr(CondVal, LoopBB, ContBB));
   CondBB = Builder->GetInsertBlock();
 
   Builder->SetInsertPoint(LoopBB);
-  auto LoopVal = Loop->codegen();
-  if (!LoopVal)
-    return nullptr;
-  Builder->CreateBr(CondBB);
-  LoopBB = Builder->GetInsertBlock();
+  return true;
+}
+
+Value *WhileStmtAST::codegenBackEdge(BasicBlock *CondBB, BasicBlock *ContBB)
+{
+  if (!Builder->GetInsertBlock()->getTerminator())
+  {
+    auto BackEdge = Builder->CreateBr(CondBB);
+    if (!Hints.empty())
+      BackEdge->setMetadata(LLVMContext::MD_loop, getLoopID(Hints));
+  }
 
   Builder->SetInsertPoint(ContBB);
   return ContBB;
 }
 
-Function *PrototypeAST::codegen()
+static Constant *getReductionIdentity(ReductionKind Kind, Type *Ty)
 {
-  Type *ResultTy;
-  switch (FnType)
+  auto ElTy = Ty->getScalarType();
+  bool FP = ElTy->isFloatingPointTy();
+  unsigned Bits = FP ? 0 : ElTy->getIntegerBitWidth();
+  switch (Kind)
   {
-  case type_int:
-    ResultTy = IntType;
-    break;
-  case type_double:
-    ResultTy = FPType;
-    break;
-  case type_intptr:
-    ResultTy = IntPtrType;
-    break;
-  case type_doubleptr:
-    ResultTy = FPPtrType;
-    break;
+  case reduce_add:
+    return FP ? ConstantFP::getNegativeZero(Ty) : ConstantInt::get(Ty, 0);
+  case reduce_mul:
+    return FP ? ConstantFP::get(Ty, 1.0) : ConstantInt::get(Ty, 1);
+  case reduce_min:
+    return FP ? ConstantFP::getInfinity(Ty) : ConstantInt::get(Ty, APInt::getSignedMaxValue(Bits));
   default:
-    return LogErrorF("unknown return type");
+    return FP ? ConstantFP::getInfinity(Ty, true) : ConstantInt::get(Ty, APInt::getSignedMinValue(Bits));
   }
+}
 
-  std::vector<Type *> ArgsTy;
-  for (int i = 0, e = Args.size(); i < e; i++)
+static Value *combineReduction(ReductionKind Kind, Value *L, Value *R)
+{
+  bool FP = L->getType()->isFPOrFPVectorTy();
+  switch (Kind)
+  {
+  case reduce_add:
+    return FP ? Builder->CreateFAdd(L, R) : Builder->CreateAdd(L, R);
+  case reduce_mul:
+    return FP ? Builder->CreateFMul(L, R) : Builder->CreateMul(L, R);
+  case reduce_min:
+    return FP ? Builder->CreateMinNum(L, R) : Builder->CreateSelect(Builder->CreateICmpSLT(L, R), L, R);
+  default:
+    return FP ? Builder->CreateMaxNum(L, R) : Builder->CreateSelect(Builder->CreateICmpSGT(L, R), L, R);
+  }
+}
+
+/* void f.parfor(i8** ctx, i64 chunk, i64 begin, i64 end) runs one chunk of
+   the loop. Reductions start from their identity in a private slot and the
+   chunk's result goes to partials[chunk], so no two threads write the same
+   memory. Captured[0] is the partials array. */
+Function *ParallelForStmtAST::codegenBody(Value *Partials, std::vector<Value *> &Targets,
+                                          std::vector<Value *> &Captured)
+{
+  auto Parent = Builder->GetInsertBlock()->getParent();
+  auto I8PtrTy = Builder->getInt8PtrTy();
+  auto BodyTy = FunctionType::get(Builder->getVoidTy(), {I8PtrTy->getPointerTo(), IntType, IntType, IntType}, false);
+  auto BodyF = Function::Create(BodyTy, Function::InternalLinkage, Parent->getName() + ".parfor", TheModule.get());
+  auto Args = BodyF->arg_begin();
+  Argument *Ctx = Args++, *Chunk = Args++, *BeginArg = Args++, *EndArg = Args;
+  Ctx->setName("ctx");
+  Chunk->setName("chunk");
+  BeginArg->setName("begin");
+  EndArg->setName("end");
+
+  IRBuilderBase::InsertPointGuard Guard(*Builder);
+  ParallelOutline State{ScopeStack(), Ctx, Captured, {}};
+  std::swap(State.Outer, Scopes);
+  Scopes.Declared.emplace_back();
+  Outline = &State;
+  Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", BodyF));
+
+  auto PartialsV = Partials ? captureValue(Partials) : nullptr;
+  auto IVar = createEntryBlockAlloca(IntType, Var);
+  addVar(Var, IVar);
+  createStore(BeginArg, IVar);
+  std::vector<Value *> Slots;
+  for (size_t j = 0; j < Targets.size(); j++)
+  {
+    auto Ty = Targets[j]->getType()->getPointerElementType();
+    Slots.push_back(createEntryBlockAlloca(Ty, Reductions[j].second));
+    createStore(getReductionIdentity(getReductionKind(Reductions[j].first), Ty), Slots.back());
+    addVar(Reductions[j].second, Slots.back());
+  }
+
+  auto CondBB = BasicBlock::Create(*TheContext, "while", BodyF),
+       LoopBB = BasicBlock::Create(*TheContext, "loop", BodyF),
+       ContBB = BasicBlock::Create(*TheContext, "cont", BodyF);
+  Builder->CreateBr(CondBB);
+  Builder->SetInsertPoint(CondBB);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(createLoad(IVar), EndArg), LoopBB, ContBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  bool Ok = Body->codegen();
+  if (Ok)
   {
-    switch (ArgTypes[i])
+    createStore(Builder->CreateAdd(createLoad(IVar), ConstantInt::get(IntType, 1), "", false, true), IVar);
+    Builder->CreateBr(CondBB);
+
+    Builder->SetInsertPoint(ContBB);
+    for (size_t j = 0; j < Slots.size(); j++)
     {
-    case type_int:
-      ArgsTy.push_back(IntType);
-      break;
-    case type_double:
-      ArgsTy.push_back(FPType);
-      break;
-    case type_intptr:
-      ArgsTy.push_back(IntPtrType);
-      break;
-    case type_doubleptr:
-      ArgsTy.push_back(FPPtrType);
-      break;
-    default:
-      return LogErrorF("unknown arg type");
+      auto ArrTy = PartialsV->getType()->getPointerElementType();
+      auto Partial = Builder->CreateInBoundsGEP(ArrTy, PartialsV, {Builder->getInt64(0), Chunk, Builder->getInt32(j)});
+      createStore(createLoad(Slots[j]), Partial);
     }
+    Builder->CreateRetVoid();
+  }
+
+  Outline = nullptr;
+  Scopes = std::move(State.Outer);
+  if (!Ok)
+  {
+    BodyF->eraseFromParent();
+    return nullptr;
+  }
+  verifyFunction(*BodyF);
+  return BodyF;
+}
+
+/* The runtime (ParallelRuntime.cc) cuts [begin, end) into chunks of at
+   least grain iterations and runs them on its thread pool. Partial results
+   are combined in chunk order once all chunks are done. */
+Value *ParallelForStmtAST::codegen()
+{
+  if (Outline)
+    return LogErrorV("nested parallel for is not supported");
+
+  Value *BeginV = Begin->codegen(), *EndV = End->codegen();
+  Value *GrainV = Grain ? Grain->codegen() : ConstantInt::get(IntType, 1);
+  if (!BeginV || !(BeginV = castValue(BeginV, IntType)) ||
+      !EndV || !(EndV = castValue(EndV, IntType)) ||
+      !GrainV || !(GrainV = castValue(GrainV, IntType)))
+    return nullptr;
+
+  std::vector<Value *> Targets;
+  std::vector<Type *> PartialTys;
+  for (auto &Reduction : Reductions)
+  {
+    if (!getReductionKind(Reduction.first))
+      return LogErrorV("unknown reduction");
+    if (Reduction.second == Var)
+      return LogErrorV("loop variable cannot be a reduction");
+    auto Ptr = findVar(Reduction.second);
+    if (!Ptr)
+      return LogErrorV("Unknown variable name");
+    auto Ty = Ptr->getType()->getPointerElementType();
+    if (!Ty->isIntOrIntVectorTy() && !Ty->isFPOrFPVectorTy())
+      return LogErrorV("reduction of a value that is not a number or a vector");
+    Targets.push_back(Ptr);
+    PartialTys.push_back(Ty);
+  }
+
+  auto I64 = IntType;
+  auto I8PtrTy = Builder->getInt8PtrTy();
+  auto ChunksF = TheModule->getOrInsertFunction("__bobo_parallel_chunks", I64, I64, I64, I64);
+  Value *Chunks = nullptr;
+  Instruction *Partials = nullptr;
+  if (!Targets.empty())
+  {
+    Chunks = Builder->CreateCall(ChunksF, {BeginV, EndV, GrainV}, "chunks");
+    Partials = createArray(StructType::get(*TheContext, PartialTys), Chunks, "partials");
+  }
+
+  std::vector<Value *> Captured;
+  auto BodyF = codegenBody(Partials, Targets, Captured);
+  if (!BodyF)
+    return nullptr;
+
+  auto CtxTy = ArrayType::get(I8PtrTy, Captured.size());
+  auto Ctx = createEntryBlockAlloca(CtxTy, "ctx");
+  for (size_t k = 0; k < Captured.size(); k++)
+  {
+    auto Slot = Builder->CreateConstInBoundsGEP2_64(CtxTy, Ctx, 0, k);
+    Builder->CreateStore(Captured[k], Builder->CreateBitCast(Slot, Captured[k]->getType()->getPointerTo()));
+  }
+  auto ForF = TheModule->getOrInsertFunction("__bobo_parallel_for", Builder->getVoidTy(), BodyF->getType(),
+                                             I8PtrTy->getPointerTo(), I64, I64, I64);
+  auto Call = Builder->CreateCall(ForF, {BodyF, Builder->CreateConstInBoundsGEP2_64(CtxTy, Ctx, 0, 0),
+                                         BeginV, EndV, GrainV});
+  if (!Partials)
+    return Call;
+
+  /* for (k = 0; k < chunks; k++) target = target op partials[k] */
+  auto TheFunction = Builder->GetInsertBlock()->getParent();
+  auto PreheaderBB = Builder->GetInsertBlock();
+  auto CombineBB = BasicBlock::Create(*TheContext, "combine", TheFunction),
+       ContBB = BasicBlock::Create(*TheContext, "combined", TheFunction);
+  Builder->CreateCondBr(Builder->CreateICmpSGT(Chunks, ConstantInt::get(I64, 0)), CombineBB, ContBB);
+  Builder->SetInsertPoint(CombineBB);
+  auto K = Builder->CreatePHI(I64, 2, "k");
+  K->addIncoming(ConstantInt::get(I64, 0), PreheaderBB);
+  auto ArrTy = Partials->getType()->getPointerElementType();
+  for (size_t j = 0; j < Targets.size(); j++)
+  {
+    auto Partial = Builder->CreateInBoundsGEP(ArrTy, Partials, {Builder->getInt64(0), K, Builder->getInt32(j)});
+    auto Kind = getReductionKind(Reductions[j].first);
+    createStore(combineReduction(Kind, createLoad(Targets[j]), createLoad(Partial)), Targets[j]);
+  }
+  auto Next = Builder->CreateAdd(K, ConstantInt::get(I64, 1));
+  K->addIncoming(Next, Builder->GetInsertBlock());
+  Builder->CreateCondBr(Builder->CreateICmpSLT(Next, Chunks), CombineBB, ContBB);
+
+  Builder->SetInsertPoint(ContBB);
+  createFree(Partials);
+  return ContBB;
+}
+
+Function *PrototypeAST::codegen()
+{
+  Type *ResultTy = getValueType(FnType);
+  if (!ResultTy)
+    return LogErrorF("unknown return type");
+  /* The columns are freed when the declaring block ends. */
+  if (isColumns(ResultTy))
+    return LogErrorF("soa arrays cannot be returned");
+
+  std::vector<Type *> ArgsTy;
+  for (auto ArgType : ArgTypes)
+  {
+    auto ArgTy = getValueType(ArgType);
+    if (!ArgTy)
+      return LogErrorF("unknown arg type");
+    ArgsTy.push_back(ArgTy);
   }
 
   FunctionType *FT = FunctionType::get(ResultTy, ArgsTy, false);
@@ -430,12 +1542,35 @@ Function *PrototypeAST::codegen()
   for (auto &Arg : F->args())
     Arg.setName(Args[Idx++]);
 
+  /* cold also optimizes for size, as clang does. */
+  for (auto &Annotation : Annotations)
+  {
+    if (Annotation == "inline")
+      F->addFnAttr(Attribute::AlwaysInline);
+    else if (Annotation == "noinline")
+      F->addFnAttr(Attribute::NoInline);
+    else if (Annotation == "hot")
+      F->addFnAttr(Attribute::Hot);
+    else if (Annotation == "cold")
+    {
+      F->addFnAttr(Attribute::Cold);
+      F->addFnAttr(Attribute::OptimizeForSize);
+    }
+  }
+  if ((F->hasFnAttribute(Attribute::AlwaysInline) && F->hasFnAttribute(Attribute::NoInline)) ||
+      (F->hasFnAttribute(Attribute::Hot) && F->hasFnAttribute(Attribute::Cold)))
+  {
+    F->eraseFromParent();
+    return LogErrorF("conflicting function annotations");
+  }
+
   return F;
 }
 
 Function *FunctionAST::codegen()
 {
   auto &P = *Proto;
+  TimeTraceScope Scope("Codegen", P.getName());
   FunctionProtos[Proto->getName()] = std::move(Proto);
 
   auto TheFunction = getFunction(P.getName());
@@ -443,13 +1578,43 @@ Function *FunctionAST::codegen()
   BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
   Builder->SetInsertPoint(BB);
 
+  Scopes = ScopeStack();
+  ArgsSetupEnd = nullptr;
+  TailRecurseBB = nullptr;
   IsFunctionBlock = true;
+  profileFunctionEntry(TheFunction);
   if (!Body->codegen())
   {
     TheFunction->eraseFromParent();
+    profileFunctionDiscard();
     return nullptr;
   }
 
-  verifyFunction(*TheFunction);
+  /* Control falls off the end. That is fine after an if/else that returns
+     on both paths, where nothing reaches the block left open. */
+  auto EndBB = Builder->GetInsertBlock();
+  if (!EndBB->getTerminator())
+  {
+    if (EndBB == &TheFunction->getEntryBlock() || !pred_empty(EndBB))
+    {
+      fprintf(stderr, "Error: missing return in %s\n", P.getName().c_str());
+      TheFunction->eraseFromParent();
+      profileFunctionDiscard();
+      return nullptr;
+    }
+    Builder->CreateUnreachable();
+  }
+
+  /* Group annotated functions the way -fprofile-use groups measured ones. */
+  if (TheFunction->hasFnAttribute(Attribute::Hot))
+    TheFunction->setSectionPrefix("hot");
+  else if (TheFunction->hasFnAttribute(Attribute::Cold))
+    TheFunction->setSectionPrefix("unlikely");
+
+  profileFunctionEnd(TheFunction);
+  {
+    TimeTraceScope Scope("VerifyFunction", P.getName());
+    verifyFunction(*TheFunction);
+  }
   return TheFunction;
 }
@@ -4,16 +4,21 @@
 #define AST_CODEGEN
 #include "Parse.h"
 #include "llvm/IR/IRBuilder.h"
+#include <map>
 
 extern std::unique_ptr<LLVMContext> TheContext;
 extern std::unique_ptr<Module> TheModule;
 extern std::unique_ptr<IRBuilder<>> Builder;
 extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+extern std::map<int, std::unique_ptr<StructAST>> StructDecls;
 
 extern Type *FPType;
 extern IntegerType *IntType;
 extern PointerType *FPPtrType;
 extern PointerType *IntPtrType;
 
+extern bool TailRecursionToLoop;
+extern bool NumericMode;
+
 #undef AST_CODEGEN
 #endif
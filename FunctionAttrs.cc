@@ -0,0 +1,310 @@
+#include "FunctionAttrs.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include <map>
+#include <set>
+
+enum MemEffect
+{
+  mem_none = 0,
+  mem_read = 1,
+  mem_write = 2,
+};
+
+/* What a function (or a call graph SCC) may do, as seen by its callers. */
+struct FnEffects
+{
+  unsigned OtherMem = mem_none; /* memory the caller can observe */
+  unsigned HeapMem = mem_none;  /* malloc/free bookkeeping */
+  std::map<const Argument *, unsigned> ArgMem;
+  bool NoUnwind = true;
+  bool WillReturn = true;
+};
+
+/* CallInst::CreateMalloc/CreateFree declare these without any attributes. */
+static void annotateHeapFunctions(Module &M)
+{
+  if (auto *Malloc = M.getFunction("malloc"))
+  {
+    Malloc->setOnlyAccessesInaccessibleMemory();
+    Malloc->setDoesNotThrow();
+    Malloc->setWillReturn();
+    Malloc->setReturnDoesNotAlias();
+  }
+  if (auto *Free = M.getFunction("free"))
+  {
+    Free->setOnlyAccessesInaccessibleMemOrArgMem();
+    Free->setDoesNotThrow();
+    Free->setWillReturn();
+    Free->addParamAttr(0, Attribute::NoCapture);
+  }
+}
+
+/* Stack slots and heap cells whose address never leaves the function. */
+static bool isLocalMemory(const Value *Obj)
+{
+  if (isa<AllocaInst>(Obj))
+    return true;
+  auto *Call = dyn_cast<CallInst>(Obj);
+  auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+  if (!Callee || Callee->getName() != "malloc")
+    return false;
+  return !PointerMayBeCaptured(Obj, true, true);
+}
+
+static void addPointerEffect(FnEffects &E, const Value *Ptr, unsigned Effect)
+{
+  auto *Obj = getUnderlyingObject(Ptr);
+  if (auto *Arg = dyn_cast<Argument>(Obj))
+    E.ArgMem[Arg] |= Effect;
+  else if (!isLocalMemory(Obj))
+    E.OtherMem |= Effect;
+}
+
+static void addCallEffects(FnEffects &E, CallInst *Call, const SmallPtrSetImpl<Function *> &SCC)
+{
+  auto *Callee = Call->getCalledFunction();
+  if (!Callee)
+  {
+    E.OtherMem |= mem_read | mem_write;
+    E.NoUnwind = E.WillReturn = false;
+    return;
+  }
+
+  /* Calls inside the SCC are covered by merging the effects of all its
+     members; only the pointers handed over still need accounting. */
+  if (SCC.count(Callee))
+  {
+    for (auto &Actual : Call->args())
+      if (Actual->getType()->isPointerTy())
+        addPointerEffect(E, Actual, mem_read | mem_write);
+    return;
+  }
+
+  E.NoUnwind &= Callee->doesNotThrow();
+  E.WillReturn &= Callee->willReturn();
+  if (Callee->doesNotAccessMemory())
+    return;
+
+  unsigned Effect = Callee->onlyReadsMemory() ? mem_read : mem_read | mem_write;
+  if (Callee->onlyAccessesInaccessibleMemory())
+  {
+    E.HeapMem |= Effect;
+    return;
+  }
+  if (!Callee->onlyAccessesArgMemory() && !Callee->onlyAccessesInaccessibleMemOrArgMem())
+  {
+    E.OtherMem |= Effect;
+    return;
+  }
+
+  if (Callee->onlyAccessesInaccessibleMemOrArgMem())
+    E.HeapMem |= Effect;
+  for (unsigned i = 0, e = Call->arg_size(); i < e; i++)
+  {
+    auto *Actual = Call->getArgOperand(i);
+    if (!Actual->getType()->isPointerTy() || Call->paramHasAttr(i, Attribute::ReadNone))
+      continue;
+    addPointerEffect(E, Actual, Call->paramHasAttr(i, Attribute::ReadOnly) ? (unsigned)mem_read : Effect);
+  }
+}
+
+static void analyzeFunction(FnEffects &E, Function &F, const SmallPtrSetImpl<Function *> &SCC)
+{
+  /* A while loop may spin forever. */
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 4> BackEdges;
+  FindFunctionBackedges(F, BackEdges);
+  if (!BackEdges.empty())
+    E.WillReturn = false;
+
+  for (auto &I : instructions(F))
+  {
+    if (auto *Load = dyn_cast<LoadInst>(&I))
+      addPointerEffect(E, Load->getPointerOperand(), mem_read);
+    else if (auto *Store = dyn_cast<StoreInst>(&I))
+      addPointerEffect(E, Store->getPointerOperand(), mem_write);
+    else if (auto *Call = dyn_cast<CallInst>(&I))
+      addCallEffects(E, Call, SCC);
+  }
+}
+
+static void applyEffects(Function &F, const FnEffects &E)
+{
+  unsigned ArgMem = mem_none;
+  for (auto &Pair : E.ArgMem)
+    ArgMem |= Pair.second;
+
+  if (E.NoUnwind)
+    F.setDoesNotThrow();
+  if (E.WillReturn)
+    F.setWillReturn();
+
+  unsigned AllMem = E.OtherMem | E.HeapMem | ArgMem;
+  if (AllMem == mem_none)
+    F.setDoesNotAccessMemory();
+  else if (!(AllMem & mem_write))
+    F.setOnlyReadsMemory();
+
+  if (AllMem != mem_none && E.OtherMem == mem_none)
+  {
+    if (E.HeapMem == mem_none)
+      F.setOnlyAccessesArgMemory();
+    else if (ArgMem == mem_none)
+      F.setOnlyAccessesInaccessibleMemory();
+    else
+      F.setOnlyAccessesInaccessibleMemOrArgMem();
+  }
+
+  for (auto &Arg : F.args())
+  {
+    if (!Arg.getType()->isPointerTy())
+      continue;
+    /* Access attributes only hold if no copy of the pointer escapes. */
+    if (PointerMayBeCaptured(&Arg, true, true))
+      continue;
+    Arg.addAttr(Attribute::NoCapture);
+
+    auto Iter = E.ArgMem.find(&Arg);
+    auto Effect = Iter == E.ArgMem.end() ? (unsigned)mem_none : Iter->second;
+    if (Effect == mem_none)
+      Arg.addAttr(Attribute::ReadNone);
+    else if (Effect == mem_read)
+      Arg.addAttr(Attribute::ReadOnly);
+  }
+}
+
+/* Returned pointers that come from malloc, or from functions that return
+   fresh cells themselves, and are not captured on the way. */
+static bool returnsFreshPointer(Function &F, const SmallPtrSetImpl<Function *> &SCC)
+{
+  for (auto &BB : F)
+  {
+    auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator());
+    if (!Ret)
+      continue;
+    auto *RetVal = Ret->getReturnValue();
+    auto *Call = dyn_cast<CallInst>(getUnderlyingObject(RetVal));
+    auto *Callee = Call ? Call->getCalledFunction() : nullptr;
+    if (!Callee || !(Callee->returnDoesNotAlias() || SCC.count(Callee)))
+      return false;
+    if (PointerMayBeCaptured(RetVal, false, true))
+      return false;
+  }
+  return true;
+}
+
+/* Objects that are distinct from everything else the caller can reach. */
+static bool isDistinctObject(const Value *Obj, const std::set<const Argument *> &NoAliasArgs)
+{
+  if (auto *Arg = dyn_cast<Argument>(Obj))
+    return NoAliasArgs.count(Arg);
+  auto *Call = dyn_cast<CallInst>(Obj);
+  return Call && Call->hasRetAttr(Attribute::NoAlias);
+}
+
+/* A pointer parameter is noalias if every call site passes a distinct
+   object there and no other argument of the call refers to it. Only
+   functions whose callers are all known qualify; start optimistic and
+   drop parameters until no call site contradicts the assumption. */
+static void inferNoAliasArgs(Module &M)
+{
+  std::set<const Argument *> NoAliasArgs;
+  std::vector<Function *> Candidates;
+  for (auto &F : M)
+  {
+    if (F.isDeclaration() || !F.hasLocalLinkage())
+      continue;
+    bool AllCallsKnown = true;
+    for (auto *U : F.users())
+    {
+      auto *Call = dyn_cast<CallInst>(U);
+      AllCallsKnown &= Call && Call->getCalledOperand() == &F;
+    }
+    if (!AllCallsKnown)
+      continue;
+    Candidates.push_back(&F);
+    for (auto &Arg : F.args())
+      if (Arg.getType()->isPointerTy())
+        NoAliasArgs.insert(&Arg);
+  }
+
+  bool Changed = true;
+  while (Changed)
+  {
+    Changed = false;
+    for (auto *F : Candidates)
+      for (auto *U : F->users())
+      {
+        auto *Call = cast<CallInst>(U);
+        for (auto &Arg : F->args())
+        {
+          if (!NoAliasArgs.count(&Arg))
+            continue;
+          auto *Obj = getUnderlyingObject(Call->getArgOperand(Arg.getArgNo()));
+          bool Distinct = isDistinctObject(Obj, NoAliasArgs);
+          for (unsigned i = 0, e = Call->arg_size(); Distinct && i < e; i++)
+            if (i != Arg.getArgNo() && Call->getArgOperand(i)->getType()->isPointerTy())
+              Distinct = getUnderlyingObject(Call->getArgOperand(i)) != Obj;
+          if (!Distinct)
+          {
+            NoAliasArgs.erase(&Arg);
+            Changed = true;
+          }
+        }
+      }
+  }
+
+  for (auto *Arg : NoAliasArgs)
+    const_cast<Argument *>(Arg)->addAttr(Attribute::NoAlias);
+}
+
+void inferFunctionAttrs(Module &M)
+{
+  annotateHeapFunctions(M);
+
+  /* scc_iterator visits callees before callers, so every call outside the
+     current SCC already carries the attributes inferred for its callee. */
+  CallGraph CG(M);
+  for (auto I = scc_begin(&CG); !I.isAtEnd(); ++I)
+  {
+    SmallPtrSet<Function *, 4> SCC;
+    for (auto *Node : *I)
+    {
+      auto F = Node->getFunction();
+      if (!F || F->isDeclaration())
+      {
+        SCC.clear();
+        break;
+      }
+      SCC.insert(F);
+    }
+    if (SCC.empty())
+      continue;
+
+    FnEffects E;
+    if (I.hasCycle())
+      E.WillReturn = false;
+    for (auto *F : SCC)
+      analyzeFunction(E, *F, SCC);
+
+    for (auto *F : SCC)
+      applyEffects(*F, E);
+
+    bool Fresh = true;
+    for (auto *F : SCC)
+      if (F->getReturnType()->isPointerTy())
+        Fresh &= returnsFreshPointer(*F, SCC);
+    if (Fresh)
+      for (auto *F : SCC)
+        if (F->getReturnType()->isPointerTy())
+          F->setReturnDoesNotAlias();
+  }
+
+  inferNoAliasArgs(M);
+}
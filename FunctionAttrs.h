@@ -0,0 +1,12 @@
+#ifndef FUNCTIONATTRS_H
+#define FUNCTIONATTRS_H
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+/* Infer memory effects bottom-up over the call graph and attach
+   readnone/readonly/argmemonly/nounwind/willreturn/nocapture, then noalias
+   on fresh returned cells and on pointer parameters of internal functions. */
+void inferFunctionAttrs(Module &M);
+
+#endif
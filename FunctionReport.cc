@@ -0,0 +1,210 @@
+#include "FunctionReport.h"
+#include "MemReport.h"
+#include "llvm/ADT/Any.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+bool FunctionReport = false;
+
+struct FunctionRow
+{
+  size_t ASTNodes = 0;
+  size_t InstructionsBefore = 0, BlocksBefore = 0;
+  size_t InstructionsAfter = 0, BlocksAfter = 0;
+  bool Optimized = false;
+  double FrontendMs = 0, OptimizeMs = 0;
+  uint64_t CodeBytes = 0;
+};
+
+/* Passes run on the threads of --opt-jobs as well. */
+static std::mutex RowsLock;
+static std::map<std::string, FunctionRow> Rows;
+
+/* Source functions have no '.' in their names, the parts codegen and the
+   backend split off of them do. */
+static FunctionRow &getRow(StringRef Name)
+{
+  return Rows[Name.split('.').first.str()];
+}
+
+void noteFunctionAST(const FunctionAST &F)
+{
+  ASTMemory Usage;
+  Usage.add(F);
+  getRow(F.getName()).ASTNodes += Usage.getNodes();
+}
+
+void noteFunctionTime(StringRef Name, double Ms)
+{
+  getRow(Name).FrontendMs += Ms;
+}
+
+/* Functions of the module before optimization, the ones inlined
+   everywhere and deleted are left with nothing after it. */
+static std::vector<std::string> Unoptimized;
+
+void noteFunctionIR(const Module &M, bool Optimized)
+{
+  if (Optimized)
+    for (auto &Name : Unoptimized)
+      getRow(Name).Optimized = true;
+  Unoptimized.clear();
+  for (auto &F : M)
+  {
+    if (F.isDeclaration())
+      continue;
+    auto &Row = getRow(F.getName());
+    if (Optimized)
+    {
+      Row.InstructionsAfter += F.getInstructionCount();
+      Row.BlocksAfter += F.size();
+    }
+    else
+    {
+      Unoptimized.push_back(F.getName().str());
+      Row.InstructionsBefore += F.getInstructionCount();
+      Row.BlocksBefore += F.size();
+    }
+  }
+}
+
+bool noteFunctionCode(const std::string &ObjectName)
+{
+  auto ObjOrErr = object::ObjectFile::createObjectFile(ObjectName);
+  if (!ObjOrErr)
+  {
+    errs() << "Could not read " << ObjectName << ": " << toString(ObjOrErr.takeError()) << "\n";
+    return false;
+  }
+  for (auto &Sym : object::computeSymbolSizes(*ObjOrErr->getBinary()))
+  {
+    auto Type = Sym.first.getType();
+    auto Flags = Sym.first.getFlags();
+    auto Name = Sym.first.getName();
+    if (!Type || !Flags || !Name)
+    {
+      consumeError(Type.takeError());
+      consumeError(Flags.takeError());
+      consumeError(Name.takeError());
+      continue;
+    }
+    if (*Type != object::SymbolRef::ST_Function || (*Flags & object::SymbolRef::SF_Undefined))
+      continue;
+    getRow(*Name).CodeBytes += Sym.second;
+  }
+  return true;
+}
+
+/* Nested pass managers and loop passes run inside a function pass, only
+   the outermost one on a function is timed. */
+static thread_local std::vector<bool> PassIsFunction;
+static thread_local unsigned FunctionPassDepth = 0;
+static thread_local std::string PassFunction;
+static thread_local std::chrono::steady_clock::time_point PassStart;
+
+static void beforePass(Any IR)
+{
+  const Function *F = nullptr;
+  if (any_isa<const Function *>(IR))
+    F = any_cast<const Function *>(IR);
+  else if (any_isa<const Loop *>(IR))
+    F = any_cast<const Loop *>(IR)->getHeader()->getParent();
+  PassIsFunction.push_back(F != nullptr);
+  if (F && FunctionPassDepth++ == 0)
+  {
+    PassFunction = F->getName().str();
+    PassStart = std::chrono::steady_clock::now();
+  }
+}
+
+static void afterPass()
+{
+  bool IsFunction = PassIsFunction.back();
+  PassIsFunction.pop_back();
+  if (!IsFunction || --FunctionPassDepth)
+    return;
+  double Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - PassStart).count();
+  std::lock_guard<std::mutex> Lock(RowsLock);
+  getRow(PassFunction).OptimizeMs += Ms;
+}
+
+void registerFunctionReportCallbacks(PassInstrumentationCallbacks &PIC)
+{
+  PIC.registerBeforeNonSkippedPassCallback([](StringRef, Any IR)
+                                           { beforePass(IR); });
+  PIC.registerAfterPassCallback([](StringRef, Any, const PreservedAnalyses &)
+                                { afterPass(); });
+  PIC.registerAfterPassInvalidatedCallback([](StringRef, const PreservedAnalyses &)
+                                           { afterPass(); });
+}
+
+static std::string withExtension(const std::string &OutputName, StringRef Extension)
+{
+  SmallString<128> Path(OutputName);
+  sys::path::replace_extension(Path, Extension);
+  return Path.str().str();
+}
+
+bool writeFunctionReport(const std::string &OutputName)
+{
+  /* Largest code first, equal ones stay in name order. */
+  std::vector<std::pair<std::string, FunctionRow>> Sorted(Rows.begin(), Rows.end());
+  std::stable_sort(Sorted.begin(), Sorted.end(), [](const auto &A, const auto &B)
+                   { return A.second.CodeBytes > B.second.CodeBytes; });
+
+  std::error_code EC;
+  raw_fd_ostream JSON(withExtension(OutputName, "funcs.json"), EC, sys::fs::OF_Text);
+  if (EC)
+  {
+    errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+  raw_fd_ostream CSV(withExtension(OutputName, "funcs.csv"), EC, sys::fs::OF_Text);
+  if (EC)
+  {
+    errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+
+  json::OStream J(JSON, 2);
+  J.arrayBegin();
+  CSV << "function,ast_nodes,ir_instructions,ir_blocks,ir_instructions_optimized,ir_blocks_optimized,"
+         "frontend_ms,optimize_ms,code_bytes\n";
+  for (auto &Entry : Sorted)
+  {
+    auto &Row = Entry.second;
+    J.objectBegin();
+    J.attribute("function", Entry.first);
+    J.attribute("ast_nodes", (int64_t)Row.ASTNodes);
+    J.attribute("ir_instructions", (int64_t)Row.InstructionsBefore);
+    J.attribute("ir_blocks", (int64_t)Row.BlocksBefore);
+    /* Unknown when --cache optimized copies of the functions. */
+    J.attribute("ir_instructions_optimized", Row.Optimized ? json::Value((int64_t)Row.InstructionsAfter) : nullptr);
+    J.attribute("ir_blocks_optimized", Row.Optimized ? json::Value((int64_t)Row.BlocksAfter) : nullptr);
+    J.attribute("frontend_ms", Row.FrontendMs);
+    J.attribute("optimize_ms", Row.OptimizeMs);
+    J.attribute("code_bytes", (int64_t)Row.CodeBytes);
+    J.objectEnd();
+
+    CSV << Entry.first << "," << Row.ASTNodes << "," << Row.InstructionsBefore << "," << Row.BlocksBefore << ",";
+    if (Row.Optimized)
+      CSV << Row.InstructionsAfter << "," << Row.BlocksAfter;
+    else
+      CSV << ",";
+    CSV << "," << format("%.3f,%.3f", Row.FrontendMs, Row.OptimizeMs) << "," << Row.CodeBytes << "\n";
+  }
+  J.arrayEnd();
+  JSON << "\n";
+  return true;
+}
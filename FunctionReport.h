@@ -0,0 +1,28 @@
+#ifndef FUNCTIONREPORT_H
+#define FUNCTIONREPORT_H
+#include "AST.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include <string>
+
+using namespace llvm;
+
+/* --func-report: a row per source function with its AST nodes, IR size
+   before and after optimization, compile time and machine code bytes,
+   written as <output>.funcs.json and <output>.funcs.csv. Outlined parts
+   such as f.parfor and f.cold count for f. */
+extern bool FunctionReport;
+
+/* Hooks for the driver, called only when FunctionReport is set. */
+void noteFunctionAST(const FunctionAST &F);
+void noteFunctionTime(StringRef Name, double Ms);
+void noteFunctionIR(const Module &M, bool Optimized);
+/* Sizes of the function symbols of an object file. */
+bool noteFunctionCode(const std::string &ObjectName);
+
+/* Time spent in function and loop passes, by the function they ran on. */
+void registerFunctionReportCallbacks(PassInstrumentationCallbacks &PIC);
+
+bool writeFunctionReport(const std::string &OutputName);
+
+#endif
@@ -11,6 +11,15 @@ static std::map<std::string, Types> TypeValues{
     {"double", type_double},
     {"Int", type_intptr},
     {"Double", type_doubleptr},
+    {"double2", type_double2},
+    {"double4", type_double4},
+    {"double8", type_double8},
+    {"int4", type_int4},
+    {"int8", type_int8},
+    {"int32", type_int32},
+    {"float", type_float},
+    {"Int32", type_int32ptr},
+    {"Float", type_floatptr},
 };
 
 static std::map<std::string, Token> ReservedValues{
@@ -18,25 +27,78 @@ static std::map<std::string, Token> ReservedValues{
     {"double", tok_def},
     {"Int", tok_def},
     {"Double", tok_def},
+    {"double2", tok_def},
+    {"double4", tok_def},
+    {"double8", tok_def},
+    {"int4", tok_def},
+    {"int8", tok_def},
+    {"int32", tok_def},
+    {"float", tok_def},
+    {"Int32", tok_def},
+    {"Float", tok_def},
     {"extern", tok_extern},
     {"return", tok_return},
     {"if", tok_if},
     {"else", tok_else},
     {"while", tok_while},
+    {"struct", tok_struct},
+    {"parallel", tok_parallel},
+    {"for", tok_for},
 };
 
+/* Make a struct name usable as a type, -1 if the name is taken. */
+int addStructType(const std::string &Name)
+{
+  static int NextType = type_struct;
+  if (ReservedValues.count(Name) || NextType == type_structarray)
+    return -1;
+  TypeValues[Name] = (Types)NextType;
+  ReservedValues[Name] = tok_def;
+  return NextType++;
+}
+
+/* Undo addStructType() for a declaration that is parsed again, the type
+   number is not handed out again. */
+void removeStructType(const std::string &Name)
+{
+  auto Ty = TypeValues.find(Name);
+  if (Ty == TypeValues.end() || Ty->second < type_struct)
+    return;
+  TypeValues.erase(Ty);
+  ReservedValues.erase(Name);
+}
+
+static int LastChar = ' ';
+static size_t LexPos = 0;
+size_t TokStart = 0;
+
+void setLexerInput(FILE *Input, size_t Offset)
+{
+  fip = Input;
+  LastChar = ' ';
+  LexPos = Offset;
+}
+
+static int nextChar()
+{
+  int C = fgetc(fip);
+  if (C != EOF)
+    LexPos++;
+  return C;
+}
+
 int gettok()
 {
-  static int LastChar = ' ';
   std::map<std::string, int>::iterator iter;
 
   while (isspace(LastChar))
-    LastChar = fgetc(fip);
+    LastChar = nextChar();
+  TokStart = LastChar == EOF ? LexPos : LexPos - 1;
 
   if (isalpha(LastChar))
   {
     IdentifierStr = LastChar;
-    while (isalnum(LastChar = fgetc(fip)))
+    while (isalnum(LastChar = nextChar()))
       IdentifierStr += LastChar;
 
     auto ty = TypeValues.find(IdentifierStr);
@@ -54,7 +116,7 @@ int gettok()
   {
     IdentifierStr = LastChar;
     bool isDouble = false;
-    while (isdigit(LastChar = fgetc(fip)) || LastChar == '.')
+    while (isdigit(LastChar = nextChar()) || LastChar == '.')
     {
       isDouble |= LastChar == '.';
       IdentifierStr += LastChar;
@@ -75,8 +137,11 @@ int gettok()
     return tok_eof;
 
   int ThisChar = LastChar;
-  LastChar = fgetc(fip);
+  LastChar = nextChar();
   return ThisChar;
 }
 
-int getNextToken() { return CurTok = gettok(); }
+int getNextToken()
+{
+  return CurTok = gettok();
+}
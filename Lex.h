@@ -15,6 +15,9 @@ enum Token
 	tok_if = -8,
 	tok_else = -9,
 	tok_while = -10,
+	tok_struct = -11,
+	tok_parallel = -12,
+	tok_for = -13,
 };
 
 enum Types
@@ -23,6 +26,23 @@ enum Types
 	type_double = 2,
 	type_intptr = 3,
 	type_doubleptr = 4,
+	type_intarray = 5,
+	type_doublearray = 6,
+	type_double2 = 7,
+	type_double4 = 8,
+	type_double8 = 9,
+	type_int4 = 10,
+	type_int8 = 11,
+	type_int32 = 12,
+	type_float = 13,
+	type_int32ptr = 14,
+	type_floatptr = 15,
+	type_int32array = 16,
+	type_floatarray = 17,
+	/* Each struct gets its own type from type_struct up, arrays of it the
+	   same offset from type_structarray. */
+	type_struct = 64,
+	type_structarray = 4096,
 };
 
 union NumVal
@@ -34,6 +54,12 @@ union NumVal
 int gettok();
 extern int CurTok;
 int getNextToken();
+int addStructType(const std::string &Name);
+void removeStructType(const std::string &Name);
+/* Read from Input, whose first character is at Offset of the source. */
+void setLexerInput(FILE *Input, size_t Offset);
+/* Source offset of the first character of CurTok. */
+extern size_t TokStart;
 extern FILE *fip;
 extern std::string IdentifierStr;
 extern union NumVal NumVal;
@@ -0,0 +1,480 @@
+#include "MemReport.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <sys/resource.h>
+#include <set>
+
+bool MemReport = false;
+
+static const char *const KindNames[] = {
+    nullptr,
+    "NumberDoubleExprAST",
+    "NumberIntExprAST",
+    "VariableExprAST",
+    "IndexExprAST",
+    "FieldExprAST",
+    "BinaryExprAST",
+    "CallExprAST",
+    "DeclStmtAST",
+    "SimpStmtAST",
+    "ReturnStmtAST",
+    "BlockAST",
+    "IfElseStmtAST",
+    "WhileStmtAST",
+    "ParallelForStmtAST",
+    "PrototypeAST",
+    "FunctionAST",
+    "StructAST",
+};
+
+/* Heap bytes behind a member, nodes it points to are counted on their own. */
+static size_t heapBytes(int) { return 0; }
+static size_t heapBytes(const std::string &S)
+{
+  return S.capacity() > std::string().capacity() ? S.capacity() + 1 : 0;
+}
+template <typename T>
+static size_t heapBytes(const std::unique_ptr<T> &) { return 0; }
+template <typename A, typename B>
+static size_t heapBytes(const std::pair<A, B> &P)
+{
+  return heapBytes(P.first) + heapBytes(P.second);
+}
+template <typename T>
+static size_t heapBytes(const std::vector<T> &V)
+{
+  size_t Bytes = V.capacity() * sizeof(T);
+  for (auto &E : V)
+    Bytes += heapBytes(E);
+  return Bytes;
+}
+
+void ASTMemory::note(ASTKind Kind, size_t Bytes)
+{
+  ByKind[Kind].Count++;
+  ByKind[Kind].Bytes += Bytes;
+}
+
+void ASTMemory::add(const FunctionAST &F)
+{
+  note(ast_function, sizeof(F));
+  if (F.Proto)
+    add(*F.Proto);
+  addStmts(F.Body.get());
+}
+
+void ASTMemory::add(const PrototypeAST &P)
+{
+  note(ast_prototype, sizeof(P) + heapBytes(P.Name) + heapBytes(P.Args) +
+                          heapBytes(P.ArgTypes) + heapBytes(P.Annotations));
+}
+
+void ASTMemory::add(const StructAST &S)
+{
+  note(ast_struct, sizeof(S) + heapBytes(S.Name) + heapBytes(S.Fields) + heapBytes(S.FieldTypes));
+}
+
+void ASTMemory::addStmts(const StmtAST *Root)
+{
+  std::vector<const StmtAST *> Stmts{Root};
+  std::vector<const ExprAST *> Exprs;
+  while (!Stmts.empty())
+  {
+    auto S = Stmts.back();
+    Stmts.pop_back();
+    if (!S)
+      continue;
+    switch (S->getKind())
+    {
+    case ast_decl:
+    {
+      auto D = static_cast<const DeclStmtAST *>(S);
+      note(ast_decl, sizeof(*D) + heapBytes(D->Names) + heapBytes(D->Sizes));
+      for (auto &Size : D->Sizes)
+        Exprs.push_back(Size.get());
+      break;
+    }
+    case ast_simp:
+    {
+      auto Simp = static_cast<const SimpStmtAST *>(S);
+      note(ast_simp, sizeof(*Simp) + heapBytes(Simp->Name) + heapBytes(Simp->Field));
+      Exprs.push_back(Simp->Expr.get());
+      Exprs.push_back(Simp->Index.get());
+      break;
+    }
+    case ast_return:
+    {
+      auto Ret = static_cast<const ReturnStmtAST *>(S);
+      note(ast_return, sizeof(*Ret));
+      Exprs.push_back(Ret->Expr.get());
+      break;
+    }
+    case ast_block:
+    {
+      auto Block = static_cast<const BlockAST *>(S);
+      note(ast_block, sizeof(*Block) + heapBytes(Block->Stmts));
+      for (auto &Stmt : Block->Stmts)
+        Stmts.push_back(Stmt.get());
+      break;
+    }
+    case ast_ifelse:
+    {
+      auto If = static_cast<const IfElseStmtAST *>(S);
+      note(ast_ifelse, sizeof(*If));
+      Exprs.push_back(If->Cond.get());
+      Stmts.push_back(If->Then.get());
+      Stmts.push_back(If->Else.get());
+      break;
+    }
+    case ast_while:
+    {
+      auto While = static_cast<const WhileStmtAST *>(S);
+      note(ast_while, sizeof(*While) + heapBytes(While->Hints));
+      Exprs.push_back(While->Cond.get());
+      Stmts.push_back(While->Loop.get());
+      break;
+    }
+    case ast_parallel_for:
+    {
+      auto For = static_cast<const ParallelForStmtAST *>(S);
+      note(ast_parallel_for, sizeof(*For) + heapBytes(For->Var) + heapBytes(For->Reductions));
+      Exprs.push_back(For->Begin.get());
+      Exprs.push_back(For->End.get());
+      Exprs.push_back(For->Grain.get());
+      Stmts.push_back(For->Body.get());
+      break;
+    }
+    default:
+      break;
+    }
+    /* Expressions are flat enough to go one statement at a time. */
+    addExprs(Exprs);
+  }
+}
+
+void ASTMemory::addExprs(std::vector<const ExprAST *> &Work)
+{
+  while (!Work.empty())
+  {
+    auto E = Work.back();
+    Work.pop_back();
+    if (!E)
+      continue;
+    switch (E->getKind())
+    {
+    case ast_number_double:
+      note(ast_number_double, sizeof(NumberDoubleExprAST));
+      break;
+    case ast_number_int:
+      note(ast_number_int, sizeof(NumberIntExprAST));
+      break;
+    case ast_variable:
+    {
+      auto V = static_cast<const VariableExprAST *>(E);
+      note(ast_variable, sizeof(*V) + heapBytes(V->Name));
+      break;
+    }
+    case ast_index:
+    {
+      auto Index = static_cast<const IndexExprAST *>(E);
+      note(ast_index, sizeof(*Index) + heapBytes(Index->Name));
+      Work.push_back(Index->Index.get());
+      break;
+    }
+    case ast_field:
+    {
+      auto Field = static_cast<const FieldExprAST *>(E);
+      note(ast_field, sizeof(*Field) + heapBytes(Field->Name) + heapBytes(Field->Field));
+      Work.push_back(Field->Index.get());
+      break;
+    }
+    case ast_binary:
+    {
+      auto Bin = static_cast<const BinaryExprAST *>(E);
+      note(ast_binary, sizeof(*Bin));
+      Work.push_back(Bin->LHS.get());
+      Work.push_back(Bin->RHS.get());
+      break;
+    }
+    case ast_call:
+    {
+      auto Call = static_cast<const CallExprAST *>(E);
+      note(ast_call, sizeof(*Call) + heapBytes(Call->Callee) + heapBytes(Call->Args));
+      for (auto &Arg : Call->Args)
+        Work.push_back(Arg.get());
+      break;
+    }
+    default:
+      break;
+    }
+  }
+}
+
+void ASTMemory::add(const ASTMemory &Other)
+{
+  for (int Kind = 0; Kind <= ast_struct; Kind++)
+  {
+    ByKind[Kind].Count += Other.ByKind[Kind].Count;
+    ByKind[Kind].Bytes += Other.ByKind[Kind].Bytes;
+  }
+}
+
+size_t ASTMemory::getNodes() const
+{
+  size_t Nodes = 0;
+  for (auto &U : ByKind)
+    Nodes += U.Count;
+  return Nodes;
+}
+
+size_t ASTMemory::getBytes() const
+{
+  size_t Bytes = 0;
+  for (auto &U : ByKind)
+    Bytes += U.Bytes;
+  return Bytes;
+}
+
+/* Module contents that take memory in it or in its context. Constants and
+   metadata are uniqued in the context, so only the distinct ones the module
+   refers to are counted. */
+struct ModuleStats
+{
+  size_t Functions = 0, Declarations = 0, GlobalVariables = 0;
+  size_t BasicBlocks = 0, Instructions = 0;
+  size_t Constants = 0, MetadataNodes = 0, MetadataStrings = 0;
+  size_t NamedMetadata = 0, StructTypes = 0;
+};
+
+static ModuleStats getModuleStats(const Module &M)
+{
+  ModuleStats Stats;
+  std::set<const Constant *> Constants;
+  std::vector<const Constant *> ConstWork;
+  std::set<const Metadata *> Metadatas;
+  std::vector<const Metadata *> MDWork;
+  SmallVector<std::pair<unsigned, MDNode *>, 8> MDs;
+
+  auto AddMDs = [&]
+  {
+    for (auto &MD : MDs)
+      MDWork.push_back(MD.second);
+    MDs.clear();
+  };
+  for (auto &GV : M.globals())
+  {
+    Stats.GlobalVariables++;
+    if (GV.hasInitializer())
+      ConstWork.push_back(GV.getInitializer());
+    GV.getAllMetadata(MDs);
+    AddMDs();
+  }
+  for (auto &F : M)
+  {
+    if (F.isDeclaration())
+    {
+      Stats.Declarations++;
+      continue;
+    }
+    Stats.Functions++;
+    Stats.BasicBlocks += F.size();
+    F.getAllMetadata(MDs);
+    AddMDs();
+    for (auto &I : instructions(F))
+    {
+      Stats.Instructions++;
+      for (auto &Op : I.operands())
+        if (auto C = dyn_cast<Constant>(Op))
+          ConstWork.push_back(C);
+      I.getAllMetadata(MDs);
+      AddMDs();
+    }
+  }
+  for (auto &NMD : M.named_metadata())
+  {
+    Stats.NamedMetadata++;
+    for (auto Op : NMD.operands())
+      MDWork.push_back(Op);
+  }
+
+  while (!ConstWork.empty())
+  {
+    auto C = ConstWork.back();
+    ConstWork.pop_back();
+    if (isa<GlobalValue>(C) || !Constants.insert(C).second)
+      continue;
+    for (auto &Op : C->operands())
+      ConstWork.push_back(cast<Constant>(Op));
+  }
+  while (!MDWork.empty())
+  {
+    auto MD = MDWork.back();
+    MDWork.pop_back();
+    if (!MD || !Metadatas.insert(MD).second)
+      continue;
+    if (isa<MDString>(MD))
+      Stats.MetadataStrings++;
+    else if (auto N = dyn_cast<MDNode>(MD))
+    {
+      Stats.MetadataNodes++;
+      for (auto &Op : N->operands())
+        MDWork.push_back(Op.get());
+    }
+  }
+  Stats.Constants = Constants.size();
+  Stats.StructTypes = M.getIdentifiedStructTypes().size();
+  return Stats;
+}
+
+struct MemPhase
+{
+  std::string Name;
+  size_t RSS, Malloc;
+  bool HasModule;
+  ModuleStats Module;
+};
+
+static std::vector<MemPhase> Phases;
+static ASTMemory ASTTotal;
+static size_t LargestASTItem = 0;
+static SymbolTableUsage SymbolTablePeak;
+
+/* Resident set in KB, 0 where /proc is missing. */
+static size_t getCurrentRSS()
+{
+  size_t Pages = 0;
+  if (FILE *F = fopen("/proc/self/statm", "r"))
+  {
+    if (fscanf(F, "%*u %zu", &Pages) != 1)
+      Pages = 0;
+    fclose(F);
+  }
+  return Pages * sys::Process::getPageSizeEstimate() / 1024;
+}
+
+static size_t getPeakRSS()
+{
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+  return Usage.ru_maxrss;
+}
+
+template <typename T>
+static void addASTItem(const T &Node)
+{
+  ASTMemory Item;
+  Item.add(Node);
+  ASTTotal.add(Item);
+  LargestASTItem = std::max(LargestASTItem, Item.getBytes());
+}
+
+void noteASTItem(const FunctionAST &F) { addASTItem(F); }
+void noteASTItem(const PrototypeAST &P) { addASTItem(P); }
+void noteASTItem(const StructAST &S) { addASTItem(S); }
+
+void noteSymbolTables(const SymbolTableUsage &Now)
+{
+  auto &Peak = SymbolTablePeak;
+  Peak.Scopes = std::max(Peak.Scopes, Now.Scopes);
+  Peak.Variables = std::max(Peak.Variables, Now.Variables);
+  Peak.VariableBytes = std::max(Peak.VariableBytes, Now.VariableBytes);
+  Peak.HeapValues = std::max(Peak.HeapValues, Now.HeapValues);
+  Peak.FunctionProtos = std::max(Peak.FunctionProtos, Now.FunctionProtos);
+  Peak.StructDecls = std::max(Peak.StructDecls, Now.StructDecls);
+}
+
+void noteMemPhase(StringRef Phase, const Module *M)
+{
+  MemPhase P{Phase.str(), getCurrentRSS(), sys::Process::GetMallocUsage(), M != nullptr, {}};
+  if (M)
+    P.Module = getModuleStats(*M);
+  Phases.push_back(std::move(P));
+}
+
+static void writeModuleStats(json::OStream &J, const ModuleStats &S)
+{
+  J.attribute("functions", (int64_t)S.Functions);
+  J.attribute("declarations", (int64_t)S.Declarations);
+  J.attribute("global_variables", (int64_t)S.GlobalVariables);
+  J.attribute("basic_blocks", (int64_t)S.BasicBlocks);
+  J.attribute("instructions", (int64_t)S.Instructions);
+  J.attribute("constants", (int64_t)S.Constants);
+  J.attribute("metadata_nodes", (int64_t)S.MetadataNodes);
+  J.attribute("metadata_strings", (int64_t)S.MetadataStrings);
+  J.attribute("named_metadata", (int64_t)S.NamedMetadata);
+  J.attribute("struct_types", (int64_t)S.StructTypes);
+}
+
+static void writePhases(json::OStream &J)
+{
+  for (auto &P : Phases)
+  {
+    J.objectBegin();
+    J.attribute("phase", P.Name);
+    J.attribute("rss_kb", (int64_t)P.RSS);
+    J.attribute("malloc_bytes", (int64_t)P.Malloc);
+    if (P.HasModule)
+      J.attributeObject("module", [&]
+                        { writeModuleStats(J, P.Module); });
+    J.objectEnd();
+  }
+}
+
+static void writeAST(json::OStream &J)
+{
+  J.attribute("nodes", (int64_t)ASTTotal.getNodes());
+  J.attribute("bytes", (int64_t)ASTTotal.getBytes());
+  J.attribute("largest_item_bytes", (int64_t)LargestASTItem);
+  J.attributeBegin("classes");
+  J.objectBegin();
+  for (int Kind = ast_number_double; Kind <= ast_struct; Kind++)
+  {
+    auto &U = ASTTotal.get((ASTKind)Kind);
+    J.attributeObject(KindNames[Kind], [&]
+                      {
+                        J.attribute("count", (int64_t)U.Count);
+                        J.attribute("bytes", (int64_t)U.Bytes); });
+  }
+  J.objectEnd();
+  J.attributeEnd();
+}
+
+static void writeSymbolTables(json::OStream &J)
+{
+  auto &Peak = SymbolTablePeak;
+  J.attribute("scopes", (int64_t)Peak.Scopes);
+  J.attribute("variables", (int64_t)Peak.Variables);
+  J.attribute("variable_bytes", (int64_t)Peak.VariableBytes);
+  J.attribute("heap_values", (int64_t)Peak.HeapValues);
+  J.attribute("function_protos", (int64_t)Peak.FunctionProtos);
+  J.attribute("struct_decls", (int64_t)Peak.StructDecls);
+}
+
+bool writeMemReport(const std::string &FileName)
+{
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::OF_Text);
+  if (EC)
+  {
+    errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+
+  json::OStream J(OS, 2);
+  J.objectBegin();
+  J.attribute("peak_rss_kb", (int64_t)getPeakRSS());
+  J.attributeArray("phases", [&]
+                   { writePhases(J); });
+  J.attributeObject("ast", [&]
+                    { writeAST(J); });
+  J.attributeObject("symbol_tables", [&]
+                    { writeSymbolTables(J); });
+  J.objectEnd();
+  OS << "\n";
+  return true;
+}
@@ -0,0 +1,63 @@
+#ifndef MEMREPORT_H
+#define MEMREPORT_H
+#include "AST.h"
+#include "llvm/IR/Module.h"
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/* --mem-report[=file]: RSS after every phase, the AST by node class, the
+   largest the symbol tables got and the size of the module, as JSON. */
+extern bool MemReport;
+
+/* Nodes and bytes of the AST by node class, the strings and vectors a
+   node owns are counted with it. */
+class ASTMemory
+{
+public:
+  struct Usage
+  {
+    size_t Count = 0;
+    size_t Bytes = 0;
+  };
+
+  void add(const FunctionAST &F);
+  void add(const PrototypeAST &P);
+  void add(const StructAST &S);
+  void add(const ASTMemory &Other);
+  const Usage &get(ASTKind Kind) const { return ByKind[Kind]; }
+  size_t getNodes() const;
+  size_t getBytes() const;
+
+private:
+  Usage ByKind[ast_struct + 1];
+
+  void note(ASTKind Kind, size_t Bytes);
+  void addStmts(const StmtAST *Root);
+  void addExprs(std::vector<const ExprAST *> &Work);
+};
+
+/* Sizes of the symbol tables at one point of codegen. */
+struct SymbolTableUsage
+{
+  size_t Scopes = 0;
+  size_t Variables = 0;
+  size_t VariableBytes = 0;
+  size_t HeapValues = 0;
+  size_t FunctionProtos = 0;
+  size_t StructDecls = 0;
+};
+
+/* Hooks for the driver and codegen, they are only called when MemReport
+   is set. The symbol tables are noted whenever a scope is about to close,
+   where they are largest. */
+void noteASTItem(const FunctionAST &F);
+void noteASTItem(const PrototypeAST &P);
+void noteASTItem(const StructAST &S);
+void noteSymbolTables(const SymbolTableUsage &Now);
+void noteMemPhase(StringRef Phase, const Module *M = nullptr);
+
+bool writeMemReport(const std::string &FileName);
+
+#endif
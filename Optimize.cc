@@ -0,0 +1,291 @@
+#include "Optimize.h"
+#include "FunctionReport.h"
+#include "TimeTrace.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Linker/Linker.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/ConstantMerge.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <functional>
+#include <tuple>
+#include <vector>
+
+TargetLibraryInfoImpl::VectorLibrary VecLib = TargetLibraryInfoImpl::NoLibrary;
+unsigned OptimizeJobs = 0;
+
+typedef std::function<ModulePassManager(PassBuilder &)> PipelineBuilder;
+
+static void runPipeline(Module &M, TargetMachine *TM, const PipelineBuilder &Build)
+{
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  /* Registered before the defaults, so this one is used. */
+  TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+  TLII.addVectorizableFunctionsFromVecLib(VecLib);
+  FAM.registerPass([&]
+                   { return TargetLibraryAnalysis(TLII); });
+
+  PassInstrumentationCallbacks PIC;
+  if (timeTraceProfilerEnabled())
+    registerTimeTraceCallbacks(PIC);
+  if (FunctionReport)
+    registerFunctionReportCallbacks(PIC);
+  PassBuilder PB(TM, PipelineTuningOptions(), None, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  Build(PB).run(M, MAM);
+}
+
+/* Declare in Part every global F refers to, directly or through constants. */
+static void declareReferences(Module &Part, Function &F, ValueToValueMapTy &VMap)
+{
+  std::vector<Constant *> Worklist;
+  for (auto &I : instructions(F))
+    for (auto &Op : I.operands())
+      if (auto C = dyn_cast<Constant>(Op))
+        Worklist.push_back(C);
+  while (!Worklist.empty())
+  {
+    auto C = Worklist.back();
+    Worklist.pop_back();
+    if (auto GV = dyn_cast<GlobalValue>(C))
+    {
+      if (VMap.count(GV))
+        continue;
+      if (auto Callee = dyn_cast<Function>(GV))
+      {
+        auto Decl = Function::Create(Callee->getFunctionType(), GlobalValue::ExternalLinkage, Callee->getName(), Part);
+        Decl->copyAttributesFrom(Callee);
+        VMap[GV] = Decl;
+      }
+      else if (auto Var = dyn_cast<GlobalVariable>(GV))
+        VMap[GV] = new GlobalVariable(Part, Var->getValueType(), Var->isConstant(), GlobalValue::ExternalLinkage,
+                                      nullptr, Var->getName(), nullptr, Var->getThreadLocalMode(), Var->getAddressSpace());
+      continue;
+    }
+    for (auto &Op : C->operands())
+      Worklist.push_back(cast<Constant>(Op));
+  }
+}
+
+std::unique_ptr<Module> extractFunctions(Module &M, ArrayRef<Function *> Fns, ArrayRef<Function *> Imported)
+{
+  auto Part = std::make_unique<Module>(M.getModuleIdentifier(), M.getContext());
+  Part->setDataLayout(M.getDataLayout());
+  Part->setTargetTriple(M.getTargetTriple());
+  /* The profile summary tells hot from cold. */
+  SmallVector<Module::ModuleFlagEntry, 4> Flags;
+  M.getModuleFlagsMetadata(Flags);
+  for (auto &Flag : Flags)
+    Part->addModuleFlag(Flag.Behavior, Flag.Key->getString(), Flag.Val);
+
+  ValueToValueMapTy VMap;
+  std::vector<std::pair<Function *, Function *>> Copies;
+  for (auto F : Fns)
+    Copies.push_back({F, Function::Create(F->getFunctionType(), F->getLinkage(), F->getName(), *Part)});
+  for (auto F : Imported)
+    Copies.push_back({F, Function::Create(F->getFunctionType(), GlobalValue::AvailableExternallyLinkage, F->getName(), *Part)});
+  for (auto &Copy : Copies)
+    VMap[Copy.first] = Copy.second;
+  for (auto &Copy : Copies)
+    declareReferences(*Part, *Copy.first, VMap);
+
+  for (auto &Copy : Copies)
+  {
+    auto NewArg = Copy.second->arg_begin();
+    for (auto &Arg : Copy.first->args())
+      VMap[&Arg] = &*NewArg++;
+    SmallVector<ReturnInst *, 4> Returns;
+    CloneFunctionInto(Copy.second, Copy.first, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+  }
+  /* Added empty by the clone, the bitcode reader warns about it. */
+  if (auto CUs = Part->getNamedMetadata("llvm.dbg.cu"))
+    Part->eraseNamedMetadata(CUs);
+  return Part;
+}
+
+/* Run the pipeline on every function in a module and context of its own,
+   so they can go in parallel. Locals are made external for the round trip,
+   so the copies link back by name, and are restored afterwards. */
+static bool runOnFunctionsInParallel(Module &M, TargetMachine *TM, const PipelineBuilder &Build)
+{
+  std::vector<std::tuple<std::string, GlobalValue::LinkageTypes, GlobalValue::VisibilityTypes>> Locals;
+  for (auto &GV : M.global_values())
+  {
+    if (!GV.hasName())
+      GV.setName("__bobo_unnamed");
+    if (GV.hasLocalLinkage())
+    {
+      Locals.emplace_back(GV.getName().str(), GV.getLinkage(), GV.getVisibility());
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setVisibility(GlobalValue::HiddenVisibility);
+    }
+  }
+
+  std::vector<std::string> Order;
+  std::vector<Function *> Defined;
+  for (auto &F : M)
+  {
+    Order.push_back(F.getName().str());
+    if (!F.isDeclaration())
+      Defined.push_back(&F);
+  }
+
+  std::vector<SmallString<0>> Bitcode(Defined.size());
+  for (size_t i = 0; i < Defined.size(); i++)
+  {
+    raw_svector_ostream OS(Bitcode[i]);
+    WriteBitcodeToFile(*extractFunctions(M, Defined[i]), OS);
+  }
+
+  auto &Target = TM->getTarget();
+  auto Triple = TM->getTargetTriple().str();
+  auto CPU = TM->getTargetCPU().str();
+  auto Features = TM->getTargetFeatureString().str();
+  auto Options = TM->Options;
+  auto RM = TM->getRelocationModel();
+  std::vector<char> Ok(Bitcode.size());
+  bool Tracing = timeTraceProfilerEnabled();
+  ThreadPool Pool(hardware_concurrency(OptimizeJobs));
+  for (size_t i = 0; i < Bitcode.size(); i++)
+    Pool.async([&, i]
+               {
+                 TimeTraceThread Thread(Tracing);
+                 TimeTraceScope Scope("OptimizeFunction", Defined[i]->getName());
+                 LLVMContext Ctx;
+                 auto PartOrErr = parseBitcodeFile(MemoryBufferRef(Bitcode[i].str(), "function"), Ctx);
+                 if (!PartOrErr)
+                 {
+                   consumeError(PartOrErr.takeError());
+                   return;
+                 }
+                 std::unique_ptr<TargetMachine> PartTM(Target.createTargetMachine(Triple, CPU, Features, Options, RM));
+                 runPipeline(**PartOrErr, PartTM.get(), Build);
+                 Bitcode[i].clear();
+                 raw_svector_ostream OS(Bitcode[i]);
+                 WriteBitcodeToFile(**PartOrErr, OS);
+                 Ok[i] = true; });
+  Pool.wait();
+
+  /* One Linker for all parts, it maps their struct types onto the ones of M. */
+  bool Linked = true;
+  for (size_t i = 0; i < Defined.size(); i++)
+    if (Ok[i])
+      Defined[i]->deleteBody();
+  Linker L(M);
+  for (size_t i = 0; i < Bitcode.size() && Linked; i++)
+  {
+    if (!Ok[i])
+      continue;
+    auto PartOrErr = parseBitcodeFile(MemoryBufferRef(Bitcode[i].str(), "function"), M.getContext());
+    if (!PartOrErr)
+    {
+      consumeError(PartOrErr.takeError());
+      Linked = false;
+    }
+    else
+      Linked = !L.linkInModule(std::move(*PartOrErr));
+  }
+
+  for (auto &Local : Locals)
+    if (auto GV = M.getNamedValue(std::get<0>(Local)))
+    {
+      GV->setLinkage(std::get<1>(Local));
+      GV->setVisibility(std::get<2>(Local));
+    }
+  for (auto &Name : Order)
+  {
+    if (auto F = M.getFunction(Name))
+    {
+      F->removeFromParent();
+      M.getFunctionList().push_back(F);
+    }
+  }
+  return Linked;
+}
+
+bool optimizeModule(Module &M, TargetMachine *TM, unsigned OptLevel, LTOKind LTO)
+{
+  if (OptLevel == 0)
+    return true;
+  TimeTraceScope Scope("Optimize");
+
+  OptimizationLevel Level = OptLevel == 1   ? OptimizationLevel::O1
+                            : OptLevel == 2 ? OptimizationLevel::O2
+                                            : OptimizationLevel::O3;
+  auto PreLink = [&](PassBuilder &PB)
+  {
+    if (LTO == lto_thin)
+      return PB.buildThinLTOPreLinkDefaultPipeline(Level);
+    if (LTO == lto_full)
+      return PB.buildLTOPreLinkDefaultPipeline(Level);
+    return PB.buildPerModuleDefaultPipeline(Level);
+  };
+  if (!OptimizeJobs)
+  {
+    runPipeline(M, TM, PreLink);
+    return true;
+  }
+
+  /* --opt-jobs: functions are simplified on their own first, so the
+     inliner sees their real size. The inliner is the only pass that needs
+     the whole module; it runs without the simplification the per-module
+     pipeline nests in it, that and the optimization part (vectorizer,
+     unroller, ...) go in parallel again after it. */
+  auto Simplify = [&](PassBuilder &PB)
+  {
+    return createModuleToFunctionPassAdaptor(PB.buildFunctionSimplificationPipeline(Level, ThinOrFullLTOPhase::None));
+  };
+  bool Ok = runOnFunctionsInParallel(M, TM, [&](PassBuilder &PB)
+                                     {
+                                       ModulePassManager MPM;
+                                       MPM.addPass(Simplify(PB));
+                                       return MPM; });
+  if (Ok && LTO)
+    runPipeline(M, TM, PreLink);
+  else if (Ok)
+  {
+    runPipeline(M, TM, [&](PassBuilder &)
+                {
+                  ModulePassManager MPM;
+                  MPM.addPass(ModuleInlinerWrapperPass(getInlineParams(Level.getSpeedupLevel(), Level.getSizeLevel())));
+                  return MPM; });
+    Ok = runOnFunctionsInParallel(M, TM, [&](PassBuilder &PB)
+                                  {
+                                    ModulePassManager MPM;
+                                    MPM.addPass(Simplify(PB));
+                                    MPM.addPass(PB.buildModuleOptimizationPipeline(Level));
+                                    return MPM; });
+    /* The module passes of that part only saw one function at a time. */
+    runPipeline(M, TM, [&](PassBuilder &)
+                {
+                  ModulePassManager MPM;
+                  MPM.addPass(GlobalDCEPass());
+                  MPM.addPass(ConstantMergePass());
+                  return MPM; });
+  }
+  /* The bodies that did not link back are gone, the module is unusable. */
+  if (!Ok)
+    fprintf(stderr, "Error: functions optimized in parallel could not be linked back\n");
+  return Ok;
+}
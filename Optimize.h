@@ -0,0 +1,34 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+enum LTOKind
+{
+  lto_none = 0,
+  lto_full = 1,
+  lto_thin = 2,
+};
+
+/* -fveclib=: SIMD variants the vectorizer may call for math functions. */
+extern TargetLibraryInfoImpl::VectorLibrary VecLib;
+
+/* --opt-jobs=N: simplify every function on its own on N threads before
+   the module pipeline, 0 runs the module pipeline alone. */
+extern unsigned OptimizeJobs;
+
+/* A module in the context of M with copies of Fns, available_externally
+   copies of Imported for the inliner, and declarations of the rest they
+   refer to. */
+std::unique_ptr<Module> extractFunctions(Module &M, ArrayRef<Function *> Fns, ArrayRef<Function *> Imported = None);
+
+/* Run the default -O<OptLevel> pipeline; level 0 leaves the module untouched.
+   With LTO only the pre-link part runs, the rest happens at link time.
+   Returns false when --opt-jobs could not put the module back together,
+   it is missing function bodies then and must not be emitted. */
+bool optimizeModule(Module &M, TargetMachine *TM, unsigned OptLevel, LTOKind LTO = lto_none);
+
+#endif
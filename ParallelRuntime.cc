@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//===----------------------------------------------------------------------===//
+// Runtime for parallel for loops, link it next to the compiled object with
+// -pthread. The worker threads are started by the first loop and kept,
+// BOBO_NUM_THREADS sets their number (default: one per core). A loop is cut
+// into chunks, every thread starts on its own run of chunks and steals the
+// back half of another run once its own is empty.
+//===----------------------------------------------------------------------===//
+
+typedef void (*BodyFn)(void **Ctx, int64_t Chunk, int64_t Begin, int64_t End);
+
+/* Chunks [Next, End) not started yet, the owner takes them from the front. */
+struct alignas(64) Run
+{
+  std::mutex Lock;
+  int64_t Next = 0, End = 0;
+};
+
+struct Pool
+{
+  unsigned NumThreads;
+  std::unique_ptr<Run[]> Runs;
+  std::mutex Lock;
+  std::condition_variable Wake, Done;
+  uint64_t Generation = 0;
+  unsigned Finished = 0;
+
+  /* The loop being run. */
+  BodyFn Body;
+  void **Ctx;
+  int64_t Begin, End, ChunkSize;
+};
+
+static Pool *ThePool;
+
+/* Set on pool threads and while the caller runs a loop, a loop started
+   from inside a body runs on the current thread. */
+static thread_local bool InLoop = false;
+
+static unsigned getNumThreads()
+{
+  static unsigned NumThreads = []
+  {
+    auto Env = getenv("BOBO_NUM_THREADS");
+    int N = Env ? atoi(Env) : (int)std::thread::hardware_concurrency();
+    return (unsigned)std::max(N, 1);
+  }();
+  return NumThreads;
+}
+
+/* Eight chunks per thread leave enough to steal without much overhead. */
+static int64_t getChunkSize(int64_t Begin, int64_t End, int64_t Grain)
+{
+  int64_t Target = getNumThreads() * 8;
+  return std::max<int64_t>({Grain, (End - Begin + Target - 1) / Target, 1});
+}
+
+extern "C" int64_t __bobo_parallel_chunks(int64_t Begin, int64_t End, int64_t Grain)
+{
+  if (End <= Begin)
+    return 0;
+  auto Size = getChunkSize(Begin, End, Grain);
+  return (End - Begin + Size - 1) / Size;
+}
+
+static void runChunk(Pool &P, int64_t Chunk)
+{
+  auto Begin = P.Begin + Chunk * P.ChunkSize;
+  P.Body(P.Ctx, Chunk, Begin, std::min(P.End, Begin + P.ChunkSize));
+}
+
+static bool steal(Pool &P, unsigned Self)
+{
+  for (unsigned i = 1; i < P.NumThreads; i++)
+  {
+    auto &Victim = P.Runs[(Self + i) % P.NumThreads];
+    int64_t Next, End;
+    {
+      std::lock_guard<std::mutex> Guard(Victim.Lock);
+      auto Left = Victim.End - Victim.Next;
+      if (Left <= 0)
+        continue;
+      Next = Victim.End - (Left + 1) / 2;
+      End = Victim.End;
+      Victim.End = Next;
+    }
+    auto &Own = P.Runs[Self];
+    std::lock_guard<std::mutex> Guard(Own.Lock);
+    Own.Next = Next;
+    Own.End = End;
+    return true;
+  }
+  return false;
+}
+
+/* Returns once no run has chunks left, the chunks still running belong to
+   the threads running them. */
+static void work(Pool &P, unsigned Self)
+{
+  auto &Own = P.Runs[Self];
+  while (true)
+  {
+    int64_t Chunk = -1;
+    {
+      std::lock_guard<std::mutex> Guard(Own.Lock);
+      if (Own.Next < Own.End)
+        Chunk = Own.Next++;
+    }
+    if (Chunk >= 0)
+      runChunk(P, Chunk);
+    else if (!steal(P, Self))
+      return;
+  }
+}
+
+static void workerMain(Pool *P, unsigned Self)
+{
+  InLoop = true;
+  uint64_t Seen = 0;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> Lock(P->Lock);
+      P->Wake.wait(Lock, [&]
+                   { return P->Generation != Seen; });
+      Seen = P->Generation;
+    }
+    work(*P, Self);
+    std::lock_guard<std::mutex> Lock(P->Lock);
+    if (++P->Finished == P->NumThreads - 1)
+      P->Done.notify_one();
+  }
+}
+
+static Pool &getPool()
+{
+  if (!ThePool)
+  {
+    ThePool = new Pool();
+    ThePool->NumThreads = getNumThreads();
+    ThePool->Runs.reset(new Run[ThePool->NumThreads]);
+    /* Thread 0 is the one calling __bobo_parallel_for. */
+    for (unsigned i = 1; i < ThePool->NumThreads; i++)
+      std::thread(workerMain, ThePool, i).detach();
+  }
+  return *ThePool;
+}
+
+extern "C" void __bobo_parallel_for(BodyFn Body, void **Ctx, int64_t Begin, int64_t End, int64_t Grain)
+{
+  auto Chunks = __bobo_parallel_chunks(Begin, End, Grain);
+  auto ChunkSize = getChunkSize(Begin, End, Grain);
+  if (InLoop || Chunks <= 1 || getNumThreads() == 1)
+  {
+    for (int64_t Chunk = 0; Chunk < Chunks; Chunk++)
+    {
+      auto ChunkBegin = Begin + Chunk * ChunkSize;
+      Body(Ctx, Chunk, ChunkBegin, std::min(End, ChunkBegin + ChunkSize));
+    }
+    return;
+  }
+
+  /* The workers are all waiting, nothing else touches the pool. */
+  auto &P = getPool();
+  P.Body = Body;
+  P.Ctx = Ctx;
+  P.Begin = Begin;
+  P.End = End;
+  P.ChunkSize = ChunkSize;
+  for (unsigned i = 0; i < P.NumThreads; i++)
+  {
+    P.Runs[i].Next = Chunks * i / P.NumThreads;
+    P.Runs[i].End = Chunks * (i + 1) / P.NumThreads;
+  }
+  {
+    std::lock_guard<std::mutex> Lock(P.Lock);
+    P.Finished = 0;
+    P.Generation++;
+  }
+  P.Wake.notify_all();
+
+  InLoop = true;
+  work(P, 0);
+  InLoop = false;
+
+  std::unique_lock<std::mutex> Lock(P.Lock);
+  P.Done.wait(Lock, [&]
+              { return P.Finished == P.NumThreads - 1; });
+}
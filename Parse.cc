@@ -1,5 +1,6 @@
 #include "Lex.h"
 #include "Parse.h"
+#include "llvm/Support/TimeProfiler.h"
 
 static std::unique_ptr<ExprAST> LogErrorE(const char *Str)
 {
@@ -13,6 +14,12 @@ static std::unique_ptr<StmtAST> LogErrorS(const char *Str)
   return nullptr;
 }
 
+static std::unique_ptr<BlockAST> LogErrorB(const char *Str)
+{
+  LogErrorE(Str);
+  return nullptr;
+}
+
 static std::unique_ptr<PrototypeAST> LogErrorP(const char *Str)
 {
   LogErrorE(Str);
@@ -25,6 +32,12 @@ static std::unique_ptr<FunctionAST> LogErrorF(const char *Str)
   return nullptr;
 }
 
+static std::unique_ptr<StructAST> LogErrorT(const char *Str)
+{
+  LogErrorE(Str);
+  return nullptr;
+}
+
 std::unique_ptr<PrototypeAST> ParseExternFunctionDeclaration()
 {
   if (getNextToken() != tok_def) // eat 'extern'
@@ -43,16 +56,91 @@ std::unique_ptr<FunctionAST> ParseFunctionDefinition()
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
+  /* Tokens are read as the parser asks for them, so this includes lexing
+     the body; a scope per token would cost more than the lexing itself. */
+  TimeTraceScope Scope("Parse", Proto->getName());
   if (CurTok != '{')
     return LogErrorF("Expected '{' in function");
   auto Body = ParseBlock();
+  if (!Body)
+    return nullptr;
   return std::make_unique<FunctionAST>(std::move(Proto), std::move(Body));
 }
 
+/* struct [aos|soa] Name { type field; ... }; */
+std::unique_ptr<StructAST> ParseStructDeclaration()
+{
+  /* Taken names are reported once the struct is read. */
+  if (getNextToken() != tok_identifier && CurTok != tok_def) // eat 'struct'
+    return LogErrorT("Expected struct name");
+  std::string Name = IdentifierStr;
+  bool SoA = false;
+  if (getNextToken() == tok_identifier || CurTok == tok_def)
+  {
+    if (Name != "aos" && Name != "soa")
+      return LogErrorT("Expected aos or soa before struct name");
+    SoA = Name == "soa";
+    Name = IdentifierStr;
+    getNextToken();
+  }
+
+  if (CurTok != '{')
+    return LogErrorT("Expected '{' in struct");
+  getNextToken(); // eat '{'
+
+  std::vector<std::string> Fields;
+  std::vector<int> FieldTypes;
+  while (CurTok != '}')
+  {
+    if (CurTok != tok_def)
+      return LogErrorT("Expected field type in struct");
+    FieldTypes.push_back(ValType);
+    if (getNextToken() != tok_identifier)
+      return LogErrorT("Expected field name in struct");
+    Fields.push_back(IdentifierStr);
+    if (getNextToken() != ';')
+      return LogErrorT("Expected ';' after field");
+    getNextToken(); // eat ';'
+  }
+  if (getNextToken() != ';') // eat '}'
+    return LogErrorT("Expected ';' after struct");
+  getNextToken(); // eat ';'
+
+  int Type = addStructType(Name);
+  if (Type < 0)
+    return LogErrorT("Struct name is already used");
+  return std::make_unique<StructAST>(Name, Type, SoA, std::move(Fields), std::move(FieldTypes));
+}
+
+/* int[], double[], int32[], float[] and arrays of structs in prototypes,
+   CurTok is the token after the type. */
+static int ParseArrayType(int Type)
+{
+  if (CurTok != '[')
+    return Type;
+  if (getNextToken() != ']') // eat '['
+    return -1;
+  getNextToken(); // eat ']'
+
+  if (Type == type_int)
+    return type_intarray;
+  if (Type == type_double)
+    return type_doublearray;
+  if (Type == type_int32)
+    return type_int32array;
+  if (Type == type_float)
+    return type_floatarray;
+  if (Type >= type_struct && Type < type_structarray)
+    return Type - type_struct + type_structarray;
+  return -1;
+}
+
 std::unique_ptr<PrototypeAST> ParsePrototype()
 {
-  Types FnType = ValType;
   getNextToken(); // eat ValType
+  int FnType = ParseArrayType(ValType);
+  if (FnType < 0)
+    return LogErrorP("Expected an array of int, double, int32, float or a struct in prototype");
 
   if (CurTok != tok_identifier)
     return LogErrorP("Expected function name in prototype");
@@ -78,8 +166,10 @@ std::unique_ptr<PrototypeAST> ParsePrototype()
   ParsePrototype_FirstArg:
     if (CurTok != tok_def)
       return LogErrorP("Expected param type in prototype");
-    ArgTypes.push_back(ValType);
     getNextToken();
+    ArgTypes.push_back(ParseArrayType(ValType));
+    if (ArgTypes.back() < 0)
+      return LogErrorP("Expected an array of int, double, int32, float or a struct in prototype");
 
     if (CurTok != tok_identifier)
       return LogErrorP("Expected param name in prototype");
@@ -92,36 +182,112 @@ std::unique_ptr<PrototypeAST> ParsePrototype()
 ParsePrototype_NoArg:
   getNextToken(); // eat ')'.
 
-  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), std::move(ArgTypes), FnType);
+  std::vector<std::string> Annotations;
+  while (CurTok == tok_identifier)
+  {
+    if (IdentifierStr != "inline" && IdentifierStr != "noinline" &&
+        IdentifierStr != "hot" && IdentifierStr != "cold")
+      return LogErrorP("Expected inline, noinline, hot or cold after prototype");
+    Annotations.push_back(IdentifierStr);
+    getNextToken();
+  }
+
+  return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), std::move(ArgTypes), FnType,
+                                        std::move(Annotations));
 }
 
+/* Blocks inside blocks, ifs, whiles and parallel fors are parsed off a
+   stack of open blocks rather than by recursion, so nesting depth is only
+   bounded by the heap. An if, while or parallel for is parsed up to its
+   '{' and gets its block when the matching '}' is reached. */
 std::unique_ptr<BlockAST> ParseBlock()
 {
+  struct OpenBlock
+  {
+    std::vector<std::unique_ptr<StmtAST>> Stmts;
+    /* Statement the block belongs to, null for a plain block. */
+    StmtAST *Owner;
+    bool IsElse;
+  };
+  std::vector<OpenBlock> Open;
+  Open.push_back({{}, nullptr, false});
   getNextToken(); // eat '{'
 
-  std::vector<std::unique_ptr<StmtAST>> Stmts;
-  while (CurTok != '}')
+  while (true)
   {
+    if (CurTok == '}')
+    {
+      getNextToken(); // eat '}'
+      auto Block = std::make_unique<BlockAST>(std::move(Open.back().Stmts));
+      auto Owner = Open.back().Owner;
+      bool IsElse = Open.back().IsElse;
+      Open.pop_back();
+      if (Open.empty())
+        return Block;
+      if (!Owner)
+      {
+        Open.back().Stmts.push_back(std::move(Block));
+        continue;
+      }
+
+      switch (Owner->getKind())
+      {
+      case ast_ifelse:
+      {
+        auto If = static_cast<IfElseStmtAST *>(Owner);
+        if (IsElse)
+        {
+          If->setElse(std::move(Block));
+          break;
+        }
+        If->setThen(std::move(Block));
+        if (CurTok != tok_else)
+          break;
+        if (getNextToken() != '{') // eat 'else'
+          return LogErrorB("Expect '{' before else block");
+        getNextToken(); // eat '{'
+        Open.push_back({{}, Owner, true});
+        break;
+      }
+      case ast_while:
+        static_cast<WhileStmtAST *>(Owner)->setLoop(std::move(Block));
+        break;
+      default:
+        static_cast<ParallelForStmtAST *>(Owner)->setBody(std::move(Block));
+        break;
+      }
+      continue;
+    }
+
     if (CurTok == '{')
     {
-      if (auto Block = ParseBlock())
-        Stmts.push_back(std::move(Block));
-      else
-        return nullptr;
+      getNextToken(); // eat '{'
+      Open.push_back({{}, nullptr, false});
+      continue;
     }
-    else
+
+    if (CurTok != tok_if && CurTok != tok_while && CurTok != tok_parallel)
     {
-      if (auto Stmt = ParseStatement())
-        Stmts.push_back(std::move(Stmt));
-      else
+      auto Stmt = ParseStatement();
+      if (!Stmt)
         return nullptr;
+      Open.back().Stmts.push_back(std::move(Stmt));
+      continue;
     }
-  }
-  getNextToken(); // eat '}'
 
-  return std::make_unique<BlockAST>(std::move(Stmts));
+    auto Stmt = CurTok == tok_if      ? ParseIfElse()
+                : CurTok == tok_while ? ParseWhile()
+                                      : ParseParallelFor();
+    if (!Stmt)
+      return nullptr;
+    auto Owner = Stmt.get();
+    Open.back().Stmts.push_back(std::move(Stmt));
+    getNextToken(); // eat '{'
+    Open.push_back({{}, Owner, false});
+  }
 }
 
+/* Statements without a block, ParseBlock() takes the others. */
 std::unique_ptr<StmtAST> ParseStatement()
 {
   std::unique_ptr<StmtAST> Stmt;
@@ -131,47 +297,68 @@ std::unique_ptr<StmtAST> ParseStatement()
     Stmt = ParseVarDeclaration();
   else if (CurTok == tok_return)
     Stmt = ParseReturn();
-  else if (CurTok == tok_if)
-  {
-    Stmt = ParseIfElse();
-    goto ParseStatement_NoSemicolon;
-  }
-  else if (CurTok == tok_while)
-  {
-    Stmt = ParseWhile();
-    goto ParseStatement_NoSemicolon;
-  }
-
   else
     return LogErrorS("Expected statement");
 
   if (CurTok != ';')
     return LogErrorS("Expected ';' after statement");
   getNextToken(); // eat ';'
-
-ParseStatement_NoSemicolon:
-  return std::move(Stmt);
+  return Stmt;
 }
 
 std::unique_ptr<StmtAST> ParseVarDeclaration()
 {
   int Type = ValType;
   std::vector<std::string> Names;
+  std::vector<std::unique_ptr<ExprAST>> Sizes;
 
   do
   {
     if (getNextToken() != tok_identifier)
       return LogErrorS("Expected identifier in declaration");
     Names.push_back(IdentifierStr);
-  } while (getNextToken() == ',');
 
-  return std::make_unique<DeclStmtAST>(Type, std::move(Names));
+    std::unique_ptr<ExprAST> Size;
+    if (getNextToken() == '[')
+    {
+      getNextToken(); // eat '['
+      Size = ParseExpression();
+      if (!Size)
+        return nullptr;
+      if (CurTok != ']')
+        return LogErrorS("Expected ']' in array declaration");
+      getNextToken(); // eat ']'
+    }
+    Sizes.push_back(std::move(Size));
+  } while (CurTok == ',');
+
+  return std::make_unique<DeclStmtAST>(Type, std::move(Names), std::move(Sizes));
 }
 
 std::unique_ptr<StmtAST> ParseSimpleAssignment()
 {
   std::string Name = IdentifierStr;
-  if (getNextToken() != '=')
+  std::unique_ptr<ExprAST> Index;
+  if (getNextToken() == '[')
+  {
+    getNextToken(); // eat '['
+    Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return LogErrorS("Expected ']' after index");
+    getNextToken(); // eat ']'
+  }
+  std::string Field;
+  if (CurTok == '.')
+  {
+    if (getNextToken() != tok_identifier) // eat '.'
+      return LogErrorS("Expected field name after '.'");
+    Field = IdentifierStr;
+    getNextToken();
+  }
+
+  if (CurTok != '=')
     return LogErrorS("Expected '=' in simple statement");
   getNextToken(); // eat '='
 
@@ -179,7 +366,7 @@ std::unique_ptr<StmtAST> ParseSimpleAssignment()
   if (!Expr)
     return nullptr;
 
-  return std::make_unique<SimpStmtAST>(Name, std::move(Expr));
+  return std::make_unique<SimpStmtAST>(Name, std::move(Expr), std::move(Index), Field);
 }
 
 std::unique_ptr<StmtAST> ParseReturn()
@@ -205,22 +392,15 @@ std::unique_ptr<StmtAST> ParseIfElse()
   if (CurTok != ')')
     return LogErrorS("Expect ')' after if condition");
 
-  if (getNextToken() != '{') // eat ')'
+  int Likely = 0;
+  if (getNextToken() == tok_identifier && (IdentifierStr == "likely" || IdentifierStr == "unlikely")) // eat ')'
+  {
+    Likely = IdentifierStr == "likely" ? 1 : -1;
+    getNextToken();
+  }
+  if (CurTok != '{')
     return LogErrorS("Expect '{' before then block");
-  auto ThenBlock = ParseBlock();
-  if (!ThenBlock)
-    return nullptr;
-
-  if (CurTok != tok_else)
-    return std::make_unique<IfElseStmtAST>(std::move(Cond), std::move(ThenBlock), nullptr);
-
-  if (getNextToken() != '{') // eat 'else'
-    return LogErrorS("Expect '{' before else block");
-  auto ElseBlock = ParseBlock();
-  if (!ElseBlock)
-    return nullptr;
-
-  return std::make_unique<IfElseStmtAST>(std::move(Cond), std::move(ThenBlock), std::move(ElseBlock));
+  return std::make_unique<IfElseStmtAST>(std::move(Cond), nullptr, nullptr, Likely);
 }
 
 std::unique_ptr<StmtAST> ParseWhile()
@@ -235,77 +415,145 @@ std::unique_ptr<StmtAST> ParseWhile()
 
   if (CurTok != ')')
     return LogErrorS("Expect ')' after while condition");
+  getNextToken(); // eat ')'
 
-  if (getNextToken() != '{') // eat ')'
-    return LogErrorS("Expect '{' before loop block");
-  auto Loop = ParseBlock();
-  if (!Loop)
-    return nullptr;
-
-  return std::make_unique<WhileStmtAST>(std::move(Cond), std::move(Loop));
-}
-
-std::unique_ptr<ExprAST> ParseExpression()
-{
-  auto Value = ParseValue();
-  if (!Value)
-    return nullptr;
-
-  if (CurTok == '<')
+  /* unroll, unroll(N), vectorize, vectorize(width), interleave(N), distribute */
+  std::vector<std::pair<std::string, int>> Hints;
+  while (CurTok == tok_identifier)
   {
-    auto Op = CurTok;
-    getNextToken();
-
-    auto Expr = ParseExpression();
-    if (!Expr)
-      return nullptr;
-
-    return std::make_unique<BinaryExprAST>(Op, std::move(Value), std::move(Expr));
+    auto Hint = IdentifierStr;
+    if (Hint != "unroll" && Hint != "vectorize" && Hint != "interleave" && Hint != "distribute")
+      return LogErrorS("Expect unroll, vectorize, interleave or distribute after while condition");
+    int N = 0;
+    if (getNextToken() == '(')
+    {
+      if (Hint == "distribute" || getNextToken() != tok_number_int || NumVal.NumValI < 1)
+        return LogErrorS("Expect a positive count in loop hint");
+      N = NumVal.NumValI;
+      if (getNextToken() != ')')
+        return LogErrorS("Expect ')' after loop hint");
+      getNextToken(); // eat ')'
+    }
+    else if (Hint == "interleave")
+      return LogErrorS("Expect '(' after interleave");
+    Hints.push_back({Hint, N});
   }
 
-  return std::move(Value);
+  if (CurTok != '{')
+    return LogErrorS("Expect '{' before loop block");
+  return std::make_unique<WhileStmtAST>(std::move(Cond), nullptr, std::move(Hints));
 }
 
-std::unique_ptr<ExprAST> ParseValue()
+/* parallel for (i = a; i < b; grain g, reduceadd s) { ... }, the clauses
+   after the condition are optional. */
+std::unique_ptr<StmtAST> ParseParallelFor()
 {
-  auto Term = ParseTerm();
-  if (!Term)
+  if (getNextToken() != tok_for) // eat 'parallel'
+    return LogErrorS("Expect 'for' after parallel");
+  if (getNextToken() != '(') // eat 'for'
+    return LogErrorS("Expect '(' after for");
+  if (getNextToken() != tok_identifier) // eat '('
+    return LogErrorS("Expect loop variable in parallel for");
+  std::string Var = IdentifierStr;
+  if (getNextToken() != '=')
+    return LogErrorS("Expect '=' after loop variable");
+  getNextToken(); // eat '='
+
+  auto Begin = ParseExpression();
+  if (!Begin)
+    return nullptr;
+  if (CurTok != ';')
+    return LogErrorS("Expect ';' after loop start");
+  if (getNextToken() != tok_identifier || IdentifierStr != Var) // eat ';'
+    return LogErrorS("Expect loop variable in loop condition");
+  if (getNextToken() != '<')
+    return LogErrorS("Expect '<' in loop condition");
+  getNextToken(); // eat '<'
+  auto End = ParseExpression();
+  if (!End)
     return nullptr;
 
-  if (CurTok == '+' || CurTok == '-')
+  std::unique_ptr<ExprAST> Grain;
+  std::vector<std::pair<std::string, std::string>> Reductions;
+  if (CurTok == ';')
   {
-    auto Op = CurTok;
-    getNextToken();
+    do
+    {
+      if (getNextToken() != tok_identifier) // eat ';' or ','
+        return LogErrorS("Expect grain or a reduction in parallel for");
+      auto Clause = IdentifierStr;
+      getNextToken();
+      if (Clause == "grain")
+      {
+        if (!(Grain = ParseExpression()))
+          return nullptr;
+        continue;
+      }
+      if (CurTok != tok_identifier)
+        return LogErrorS("Expect variable after reduction");
+      Reductions.push_back({Clause, IdentifierStr});
+      getNextToken();
+    } while (CurTok == ',');
+  }
 
-    auto Value = ParseValue();
-    if (!Value)
-      return nullptr;
+  if (CurTok != ')')
+    return LogErrorS("Expect ')' after parallel for");
+  if (getNextToken() != '{') // eat ')'
+    return LogErrorS("Expect '{' before loop block");
+  return std::make_unique<ParallelForStmtAST>(Var, std::move(Begin), std::move(End), std::move(Grain),
+                                              std::move(Reductions), nullptr);
+}
 
-    return std::make_unique<BinaryExprAST>(Op, std::move(Term), std::move(Value));
-  }
+/* Binary operators by precedence, all of them associate to the left. */
+static const std::map<int, int> BinopPrecedence{
+    {'<', 10},
+    {'+', 20},
+    {'-', 20},
+    {'*', 40},
+};
 
-  return std::move(Term);
+static int getTokPrecedence()
+{
+  auto It = BinopPrecedence.find(CurTok);
+  return It == BinopPrecedence.end() ? -1 : It->second;
 }
 
-std::unique_ptr<ExprAST> ParseTerm()
+/* expression ::= factor (binop factor)*
+   Operands and operators waiting for their right operand are kept on
+   stacks, an operator is applied once the next one binds no tighter. A
+   chain of operators therefore takes no native stack, only parentheses
+   and calls nest. */
+std::unique_ptr<ExprAST> ParseExpression()
 {
+  std::vector<std::unique_ptr<ExprAST>> Operands;
+  std::vector<int> Operators;
+  auto Reduce = [&]
+  {
+    auto RHS = std::move(Operands.back());
+    Operands.pop_back();
+    Operands.back() = std::make_unique<BinaryExprAST>(Operators.back(), std::move(Operands.back()), std::move(RHS));
+    Operators.pop_back();
+  };
+
   auto Factor = ParseFactor();
   if (!Factor)
     return nullptr;
+  Operands.push_back(std::move(Factor));
 
-  if (CurTok == '*')
+  for (int Prec; (Prec = getTokPrecedence()) >= 0;)
   {
-    auto Op = CurTok;
-    getNextToken();
+    while (!Operators.empty() && BinopPrecedence.at(Operators.back()) >= Prec)
+      Reduce();
+    Operators.push_back(CurTok);
+    getNextToken(); // eat binop
 
-    auto Term = ParseTerm();
-    if (!Term)
+    if (!(Factor = ParseFactor()))
       return nullptr;
-
-    return std::make_unique<BinaryExprAST>(Op, std::move(Factor), std::move(Term));
+    Operands.push_back(std::move(Factor));
   }
-
-  return std::move(Factor);
+  while (!Operators.empty())
+    Reduce();
+  return std::move(Operands.back());
 }
 
 std::unique_ptr<ExprAST> ParseFactor()
@@ -358,6 +606,28 @@ std::unique_ptr<ExprAST> ParseIdentifierExpr()
   auto ident = IdentifierStr;
   getNextToken();
 
+  std::unique_ptr<ExprAST> Index;
+  if (CurTok == '[')
+  {
+    getNextToken(); // eat '['
+    Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok != ']')
+      return LogErrorE("Expected ']' after index");
+    getNextToken(); // eat ']'
+  }
+  if (CurTok == '.')
+  {
+    if (getNextToken() != tok_identifier) // eat '.'
+      return LogErrorE("Expected field name after '.'");
+    auto Field = IdentifierStr;
+    getNextToken();
+    return std::make_unique<FieldExprAST>(ident, std::move(Index), Field);
+  }
+  if (Index)
+    return std::make_unique<IndexExprAST>(ident, std::move(Index));
+
   if (CurTok != '(')
     return std::make_unique<VariableExprAST>(ident);
   getNextToken(); // eat '('
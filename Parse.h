@@ -5,6 +5,7 @@
 std::unique_ptr<PrototypeAST> ParseExternFunctionDeclaration();
 std::unique_ptr<FunctionAST> ParseFunctionDefinition();
 std::unique_ptr<PrototypeAST> ParsePrototype();
+std::unique_ptr<StructAST> ParseStructDeclaration();
 
 std::unique_ptr<BlockAST> ParseBlock();
 
@@ -12,12 +13,12 @@ std::unique_ptr<StmtAST> ParseStatement();
 std::unique_ptr<StmtAST> ParseVarDeclaration();
 std::unique_ptr<StmtAST> ParseSimpleAssignment();
 std::unique_ptr<StmtAST> ParseReturn();
+/* These three stop at the '{' of their block, ParseBlock() parses it. */
 std::unique_ptr<StmtAST> ParseIfElse();
 std::unique_ptr<StmtAST> ParseWhile();
+std::unique_ptr<StmtAST> ParseParallelFor();
 
 std::unique_ptr<ExprAST> ParseExpression();
-std::unique_ptr<ExprAST> ParseValue();
-std::unique_ptr<ExprAST> ParseTerm();
 std::unique_ptr<ExprAST> ParseFactor();
 std::unique_ptr<ExprAST> ParseNumberExpr(int NumberType);
 std::unique_ptr<ExprAST> ParseIdentifierExpr();
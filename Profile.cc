@@ -0,0 +1,226 @@
+#include "Profile.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+bool ProfileGenerate = false;
+std::string ProfileGenerateFile = "default.boboprof";
+
+/* Counters read by -fprofile-use, by function name. */
+static bool ProfileUse = false;
+static std::map<std::string, std::vector<uint64_t>> ProfileCounts;
+
+/* State of the function being lowered. The counter array is only sized
+   once the body is done, until then increments address a placeholder. */
+static unsigned NumCounters = 0;
+static GlobalVariable *CounterPlaceholder = nullptr;
+static Function *ProfiledFunction = nullptr;
+static const std::vector<uint64_t> *FunctionCounts = nullptr;
+
+/* Counter arrays of every instrumented function. */
+static std::vector<std::pair<std::string, GlobalVariable *>> CounterArrays;
+
+bool hasProfileUse() { return ProfileUse; }
+
+bool loadProfile(const std::string &FileName)
+{
+  std::ifstream In(FileName);
+  if (!In)
+    return false;
+
+  /* One line per function: name, number of counters, counters. */
+  std::string Line;
+  while (std::getline(In, Line))
+  {
+    if (Line.empty() || Line[0] == '#')
+      continue;
+    std::istringstream LS(Line);
+    std::string Name;
+    size_t N;
+    if (!(LS >> Name >> N))
+      continue;
+    std::vector<uint64_t> Counts(N);
+    for (auto &Count : Counts)
+      LS >> Count;
+    ProfileCounts[Name] = std::move(Counts);
+  }
+  ProfileUse = true;
+  return true;
+}
+
+static void emitIncrement(BasicBlock *BB)
+{
+  auto &Ctx = BB->getContext();
+  auto I64 = Type::getInt64Ty(Ctx);
+  auto Addr = ConstantExpr::getGetElementPtr(I64, CounterPlaceholder, ConstantInt::get(I64, NumCounters++));
+
+  IRBuilder<> B(BB, BB->getFirstInsertionPt());
+  /* Parallel for bodies are outlined and run on several threads at once. */
+  if (BB->getParent() != ProfiledFunction)
+  {
+    B.CreateAtomicRMW(AtomicRMWInst::Add, Addr, ConstantInt::get(I64, 1), MaybeAlign(8), AtomicOrdering::Monotonic);
+    return;
+  }
+  auto Count = B.CreateLoad(I64, Addr);
+  B.CreateStore(B.CreateAdd(Count, ConstantInt::get(I64, 1)), Addr);
+}
+
+void profileFunctionEntry(Function *F)
+{
+  NumCounters = 0;
+  ProfiledFunction = F;
+  if (ProfileGenerate)
+  {
+    auto I64 = Type::getInt64Ty(F->getContext());
+    CounterPlaceholder = new GlobalVariable(*F->getParent(), I64, false, GlobalValue::ExternalLinkage, nullptr);
+    emitIncrement(&F->getEntryBlock());
+  }
+  else if (ProfileUse)
+  {
+    auto Counts = ProfileCounts.find(std::string(F->getName()));
+    FunctionCounts = Counts == ProfileCounts.end() ? nullptr : &Counts->second;
+    if (FunctionCounts && !FunctionCounts->empty())
+      F->setEntryCount((*FunctionCounts)[0]);
+    NumCounters++;
+  }
+}
+
+void profileCondBr(BranchInst *Br)
+{
+  if (ProfileGenerate)
+  {
+    emitIncrement(Br->getSuccessor(0));
+    emitIncrement(Br->getSuccessor(1));
+    return;
+  }
+  if (!ProfileUse)
+    return;
+
+  unsigned Idx = NumCounters;
+  NumCounters += 2;
+  if (!FunctionCounts || FunctionCounts->size() < NumCounters)
+    return;
+
+  /* Branch weights are 32 bits wide. */
+  uint64_t Taken = (*FunctionCounts)[Idx], NotTaken = (*FunctionCounts)[Idx + 1];
+  uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+  if (Taken + NotTaken)
+    Br->setMetadata(LLVMContext::MD_prof, MDBuilder(Br->getContext()).createBranchWeights(Taken / Scale, NotTaken / Scale));
+}
+
+void profileFunctionEnd(Function *F)
+{
+  if (ProfileGenerate)
+  {
+    auto ArrTy = ArrayType::get(CounterPlaceholder->getValueType(), NumCounters);
+    auto Counters = new GlobalVariable(*F->getParent(), ArrTy, false, GlobalValue::PrivateLinkage,
+                                       ConstantAggregateZero::get(ArrTy), "__bobo_prof_" + F->getName());
+    CounterPlaceholder->replaceAllUsesWith(ConstantExpr::getBitCast(Counters, CounterPlaceholder->getType()));
+    CounterPlaceholder->eraseFromParent();
+    CounterPlaceholder = nullptr;
+    CounterArrays.push_back({std::string(F->getName()), Counters});
+  }
+  else if (FunctionCounts && FunctionCounts->size() != NumCounters)
+  {
+    /* The source changed since the profile was taken. */
+    fprintf(stderr, "Warning: profile of '%s' does not match, ignored\n", F->getName().str().c_str());
+    F->setMetadata(LLVMContext::MD_prof, nullptr);
+    for (auto &BB : *F)
+      BB.getTerminator()->setMetadata(LLVMContext::MD_prof, nullptr);
+  }
+  FunctionCounts = nullptr;
+}
+
+void profileFunctionDiscard()
+{
+  if (CounterPlaceholder)
+  {
+    CounterPlaceholder->replaceAllUsesWith(UndefValue::get(CounterPlaceholder->getType()));
+    CounterPlaceholder->eraseFromParent();
+    CounterPlaceholder = nullptr;
+  }
+  FunctionCounts = nullptr;
+}
+
+/* A module constructor hands every counter array to the runtime. */
+static void emitProfileRegistration(Module &M)
+{
+  auto &Ctx = M.getContext();
+  auto VoidTy = Type::getVoidTy(Ctx);
+  auto I8PtrTy = Type::getInt8PtrTy(Ctx);
+  auto I64 = Type::getInt64Ty(Ctx);
+  auto RegisterF = M.getOrInsertFunction("__bobo_profile_register", VoidTy, I8PtrTy, I8PtrTy, I64->getPointerTo(), I64);
+
+  auto Init = Function::Create(FunctionType::get(VoidTy, false), GlobalValue::InternalLinkage, "__bobo_prof_init", M);
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Init));
+  auto File = B.CreateGlobalStringPtr(ProfileGenerateFile);
+  for (auto &Array : CounterArrays)
+  {
+    auto Name = B.CreateGlobalStringPtr(Array.first);
+    auto NumCounters = Array.second->getValueType()->getArrayNumElements();
+    auto Counters = B.CreatePointerCast(Array.second, I64->getPointerTo());
+    B.CreateCall(RegisterF, {File, Name, Counters, ConstantInt::get(I64, NumCounters)});
+  }
+  B.CreateRetVoid();
+  appendToGlobalCtors(M, Init, 0);
+}
+
+/* The largest counter, so a function entered once that runs a hot loop
+   still counts as hot. */
+static uint64_t getHotness(const Function &F)
+{
+  auto &Counts = ProfileCounts[std::string(F.getName())];
+  return Counts.empty() ? 0 : *std::max_element(Counts.begin(), Counts.end());
+}
+
+void profileFinishModule(Module &M)
+{
+  /* With --stream every batch registers its own counters. */
+  if (ProfileGenerate && !CounterArrays.empty())
+    emitProfileRegistration(M);
+  CounterArrays.clear();
+  if (!ProfileUse)
+    return;
+
+  /* The summary tells the optimizer and the backend what counts as hot,
+     MachineFunctionSplitter relies on it to move cold blocks out. */
+  InstrProfSummaryBuilder Summary(ProfileSummaryBuilder::DefaultCutoffs);
+  std::vector<Function *> Defined;
+  uint64_t MaxCount = 0;
+  for (auto &F : M)
+  {
+    if (F.isDeclaration() || !F.getEntryCount())
+      continue;
+    Summary.addRecord(InstrProfRecord(ProfileCounts[std::string(F.getName())]));
+    MaxCount = std::max(MaxCount, getHotness(F));
+    Defined.push_back(&F);
+  }
+  if (Defined.empty())
+    return;
+  M.setProfileSummary(Summary.getSummary()->getMD(M.getContext()), ProfileSummary::PSK_Instr);
+
+  /* Hot functions first and in their own section, never executed ones
+     last and cold. */
+  std::stable_sort(Defined.begin(), Defined.end(), [](Function *A, Function *B)
+                   { return getHotness(*A) > getHotness(*B); });
+  for (auto F : Defined)
+  {
+    auto Count = getHotness(*F);
+    if (Count == 0 && !F->hasFnAttribute(Attribute::Hot))
+    {
+      F->addFnAttr(Attribute::Cold);
+      F->setSectionPrefix("unlikely");
+    }
+    else if (Count >= MaxCount / 100)
+      F->setSectionPrefix("hot");
+    F->removeFromParent();
+    M.getFunctionList().push_back(F);
+  }
+}
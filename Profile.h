@@ -0,0 +1,30 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include <string>
+
+using namespace llvm;
+
+/* -fprofile-generate[=file]: count function entries and both edges of
+   every if/while branch, ProfileRuntime.cc writes the counters at exit. */
+extern bool ProfileGenerate;
+extern std::string ProfileGenerateFile;
+
+/* -fprofile-use=file: attach entry counts and branch weights instead. */
+bool loadProfile(const std::string &FileName);
+
+/* Hooks called from codegen, they do nothing when profiling is off.
+   Counters are numbered in codegen order: the entry first, then two per
+   conditional branch. */
+void profileFunctionEntry(Function *F);
+void profileCondBr(BranchInst *Br);
+void profileFunctionEnd(Function *F);
+void profileFunctionDiscard();
+
+/* Register the counters with the runtime, or order functions by hotness
+   and attach the module profile summary. */
+void profileFinishModule(Module &M);
+bool hasProfileUse();
+
+#endif
@@ -0,0 +1,83 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//===----------------------------------------------------------------------===//
+// Runtime for programs built with -fprofile-generate, link it next to the
+// compiled object. Counters are written at exit and added to the counts of
+// earlier runs, BOBO_PROFILE_FILE overrides the file named at compile time.
+//===----------------------------------------------------------------------===//
+
+struct CounterArray
+{
+  const char *Name;
+  int64_t *Counters;
+  int64_t NumCounters;
+};
+
+static std::map<std::string, std::vector<CounterArray>> *ProfileFiles;
+
+static void readProfile(const std::string &FileName, std::map<std::string, std::vector<uint64_t>> &Counts)
+{
+  std::ifstream In(FileName);
+  std::string Line;
+  while (std::getline(In, Line))
+  {
+    if (Line.empty() || Line[0] == '#')
+      continue;
+    std::istringstream LS(Line);
+    std::string Name;
+    size_t N;
+    if (!(LS >> Name >> N))
+      continue;
+    auto &FnCounts = Counts[Name];
+    FnCounts.resize(N);
+    for (auto &Count : FnCounts)
+      LS >> Count;
+  }
+}
+
+static void writeProfiles()
+{
+  auto Override = getenv("BOBO_PROFILE_FILE");
+  for (auto &File : *ProfileFiles)
+  {
+    std::string FileName = Override ? Override : File.first;
+    std::map<std::string, std::vector<uint64_t>> Counts;
+    readProfile(FileName, Counts);
+
+    for (auto &Array : File.second)
+    {
+      auto &FnCounts = Counts[Array.Name];
+      if (FnCounts.size() != (size_t)Array.NumCounters)
+        FnCounts.assign(Array.NumCounters, 0);
+      for (int64_t i = 0; i < Array.NumCounters; i++)
+        FnCounts[i] += Array.Counters[i];
+    }
+
+    std::ofstream Out(FileName);
+    Out << "# BoboLang profile: name, number of counters, counters" << std::endl;
+    for (auto &Fn : Counts)
+    {
+      Out << Fn.first << " " << Fn.second.size();
+      for (auto Count : Fn.second)
+        Out << " " << Count;
+      Out << std::endl;
+    }
+  }
+}
+
+extern "C" void __bobo_profile_register(const char *File, const char *Name, int64_t *Counters, int64_t NumCounters)
+{
+  if (!ProfileFiles)
+  {
+    ProfileFiles = new std::map<std::string, std::vector<CounterArray>>();
+    atexit(writeProfiles);
+  }
+  (*ProfileFiles)[File].push_back({Name, Counters, NumCounters});
+}
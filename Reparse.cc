@@ -0,0 +1,148 @@
+#include "Reparse.h"
+#include "Lex.h"
+#include "Parse.h"
+#include <algorithm>
+#include <set>
+
+static const std::string *getName(const ASTItem &AST)
+{
+  if (AST.Function)
+    return &AST.Function->getName();
+  if (AST.Extern)
+    return &AST.Extern->getName();
+  return nullptr;
+}
+
+/* One item from CurTok on, skipping a token where parsing fails. */
+static void parseItem(ASTItem &AST)
+{
+  switch (CurTok)
+  {
+  case tok_def:
+    if (!(AST.Function = ParseFunctionDefinition()))
+      getNextToken();
+    break;
+  case tok_extern:
+    if (!(AST.Extern = ParseExternFunctionDeclaration()))
+      getNextToken();
+    break;
+  case tok_struct:
+    if (!(AST.Struct = ParseStructDeclaration()))
+      getNextToken();
+    break;
+  default:
+    getNextToken();
+    break;
+  }
+}
+
+IncrementalParser::IncrementalParser(std::string Source) : Source(std::move(Source))
+{
+  reparse(0, 0, this->Source.size(), 0, true);
+}
+
+std::vector<IncrementalParser::Item *> IncrementalParser::edit(size_t Offset, size_t Length, StringRef Text)
+{
+  Source.replace(Offset, Length, Text.data(), Text.size());
+
+  /* The item before the edit as well, its last token may run into it. */
+  auto It = std::lower_bound(Items.begin(), Items.end(), Offset, [](const Item &I, size_t Off)
+                             { return I.Begin < Off; });
+  size_t First = It == Items.begin() ? 0 : It - Items.begin() - 1;
+  ptrdiff_t Delta = (ptrdiff_t)Text.size() - (ptrdiff_t)Length;
+
+  /* Items from First to the one holding the end of the edit are parsed
+     again in any case, a struct among them or in the new text makes the
+     rest of the file lex differently. */
+  bool ToEnd = false;
+  for (size_t i = First; i < Items.size() && Items[i].Begin <= Offset + Length && !ToEnd; i++)
+    ToEnd = (bool)Items[i].AST.Struct;
+  size_t Window = Offset > 5 ? Offset - 5 : 0;
+  ToEnd |= StringRef(Source).slice(Window, Offset + Text.size() + 5).contains("struct");
+  return reparse(First, Offset, Offset + Length, Delta, ToEnd);
+}
+
+std::vector<IncrementalParser::Item *> IncrementalParser::reparse(size_t First, size_t EditBegin, size_t EditEnd,
+                                                                  ptrdiff_t Delta, bool ToEnd)
+{
+  if (ToEnd)
+    for (size_t i = First; i < Items.size(); i++)
+      if (Items[i].AST.Struct)
+        removeStructType(Items[i].AST.Struct->getName());
+
+  size_t Begin = First < Items.size() && Items[First].Begin <= EditBegin ? Items[First].Begin : 0;
+  size_t NewEditEnd = EditEnd + Delta;
+  size_t Next = First;
+  std::vector<Item> Parsed;
+  FILE *Input = Begin < Source.size() ? fmemopen(&Source[Begin], Source.size() - Begin, "r") : nullptr;
+  if (Input)
+  {
+    setLexerInput(Input, Begin);
+    getNextToken();
+  }
+
+  /* Stop at the first old item boundary past the edit, from there on the
+     text and so the items are the same as before. */
+  while (Input && CurTok != tok_eof)
+  {
+    size_t Pos = TokStart;
+    if (!ToEnd && Pos >= NewEditEnd)
+    {
+      while (Next < Items.size() && (ptrdiff_t)Items[Next].Begin + Delta < (ptrdiff_t)Pos)
+        Next++;
+      if (Next < Items.size() && (ptrdiff_t)Items[Next].Begin + Delta == (ptrdiff_t)Pos)
+        break;
+    }
+    Item I;
+    I.Begin = Pos;
+    parseItem(I.AST);
+    I.End = TokStart;
+    Parsed.push_back(std::move(I));
+  }
+  if (!Input || CurTok == tok_eof)
+    Next = Items.size();
+  if (Input)
+    fclose(Input);
+
+  /* A struct declared or dropped further on than expected, e.g. after a
+     brace was deleted. */
+  auto IsStruct = [](const Item &I)
+  { return (bool)I.AST.Struct; };
+  if (!ToEnd && (std::any_of(Parsed.begin(), Parsed.end(), IsStruct) ||
+                 std::any_of(Items.begin() + First, Items.begin() + Next, IsStruct)))
+  {
+    for (auto &I : Parsed)
+      if (I.AST.Struct)
+        removeStructType(I.AST.Struct->getName());
+    return reparse(First, EditBegin, EditEnd, Delta, true);
+  }
+
+  /* Items ending before the edit at the same span did not change. */
+  std::set<std::pair<size_t, size_t>> Unchanged;
+  std::set<std::string> Names;
+  for (size_t i = First; i < Next; i++)
+    if (Items[i].End <= EditBegin)
+      Unchanged.insert({Items[i].Begin, Items[i].End});
+  for (auto &I : Parsed)
+    if (auto Name = getName(I.AST))
+      Names.insert(*Name);
+  Removed.clear();
+  for (size_t i = First; i < Next; i++)
+    if (auto Name = getName(Items[i].AST))
+      if (!Names.count(*Name))
+        Removed.push_back(*Name);
+
+  for (size_t i = Next; i < Items.size(); i++)
+  {
+    Items[i].Begin += Delta;
+    Items[i].End += Delta;
+  }
+  Items.erase(Items.begin() + First, Items.begin() + Next);
+  Items.insert(Items.begin() + First, std::make_move_iterator(Parsed.begin()), std::make_move_iterator(Parsed.end()));
+
+  std::vector<Item *> Changed;
+  for (size_t i = First; i < First + Parsed.size(); i++)
+    if (!Unchanged.count({Items[i].Begin, Items[i].End}))
+      Changed.push_back(&Items[i]);
+  return Changed;
+}
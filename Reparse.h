@@ -0,0 +1,45 @@
+#ifndef REPARSE_H
+#define REPARSE_H
+#include "ASTFile.h"
+#include "llvm/ADT/StringRef.h"
+#include <string>
+#include <vector>
+
+/* A source buffer whose top-level items are kept with their spans, for
+   tools that re-parse while the text is edited. An edit re-lexes and
+   re-parses from the item before it up to the first item boundary past
+   it, so its cost follows the size of the edit and of the items it
+   touches. Structs change how the rest of the file lexes, an edit
+   touching one re-parses everything after it. Uses the global lexer. */
+class IncrementalParser
+{
+public:
+  /* [Begin, End) in the current source, End is where the next item
+     starts. No member of AST is set for text that did not parse. */
+  struct Item
+  {
+    size_t Begin, End;
+    ASTItem AST;
+  };
+
+  explicit IncrementalParser(std::string Source);
+
+  /* Replace Length bytes at Offset by Text. Returns the items parsed
+     again whose text changed, valid until the next edit; their ASTs may
+     be moved out for codegen. */
+  std::vector<Item *> edit(size_t Offset, size_t Length, StringRef Text);
+
+  const std::string &getSource() const { return Source; }
+  const std::vector<Item> &getItems() const { return Items; }
+  /* Functions and externs the last edit removed. */
+  const std::vector<std::string> &getRemoved() const { return Removed; }
+
+private:
+  std::string Source;
+  std::vector<Item> Items;
+  std::vector<std::string> Removed;
+
+  std::vector<Item *> reparse(size_t First, size_t EditBegin, size_t EditEnd, ptrdiff_t Delta, bool ToEnd);
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include "TimeTrace.h"
+#include "llvm/ADT/Any.h"
+#include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+unsigned TimeTraceGranularity = 500;
+
+static std::string getIRName(Any IR)
+{
+  if (any_isa<const Function *>(IR))
+    return any_cast<const Function *>(IR)->getName().str();
+  if (any_isa<const Loop *>(IR))
+  {
+    auto L = any_cast<const Loop *>(IR);
+    return (L->getHeader()->getParent()->getName() + ":" + L->getName()).str();
+  }
+  if (any_isa<const LazyCallGraph::SCC *>(IR))
+    return any_cast<const LazyCallGraph::SCC *>(IR)->getName();
+  if (any_isa<const Module *>(IR))
+    return any_cast<const Module *>(IR)->getName().str();
+  return "";
+}
+
+void registerTimeTraceCallbacks(PassInstrumentationCallbacks &PIC)
+{
+  PIC.registerBeforeNonSkippedPassCallback([](StringRef Pass, Any IR)
+                                           { timeTraceProfilerBegin(Pass, getIRName(IR)); });
+  PIC.registerAfterPassCallback([](StringRef, Any, const PreservedAnalyses &)
+                                { timeTraceProfilerEnd(); });
+  PIC.registerAfterPassInvalidatedCallback([](StringRef, const PreservedAnalyses &)
+                                           { timeTraceProfilerEnd(); });
+}
+
+TimeTraceThread::TimeTraceThread(bool Enabled) : Enabled(Enabled)
+{
+  if (Enabled)
+    timeTraceProfilerInitialize(TimeTraceGranularity, "bobo");
+}
+
+TimeTraceThread::~TimeTraceThread()
+{
+  if (Enabled)
+    timeTraceProfilerFinishThread();
+}
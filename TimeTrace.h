@@ -0,0 +1,31 @@
+#ifndef TIMETRACE_H
+#define TIMETRACE_H
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/TimeProfiler.h"
+
+using namespace llvm;
+
+/* --time-trace: the phases of a run are marked with TimeTraceScope and
+   written as Chrome trace events, see chrome://tracing or Perfetto. A
+   scope costs one thread-local load while no trace is recorded. */
+
+/* --time-trace-granularity=N: events shorter than N microseconds are only
+   counted in the totals. */
+extern unsigned TimeTraceGranularity;
+
+/* An event for every pass a new pass manager pipeline runs, named after
+   the pass, with the function, loop or module it ran on as detail. */
+void registerTimeTraceCallbacks(PassInstrumentationCallbacks &PIC);
+
+/* Records the events of a ThreadPool task into the trace, Enabled is
+   timeTraceProfilerEnabled() of the thread that started the task. */
+class TimeTraceThread
+{
+  bool Enabled;
+
+public:
+  explicit TimeTraceThread(bool Enabled);
+  ~TimeTraceThread();
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "WholeProgram.h"
+#include "llvm/IR/Instructions.h"
+
+static std::set<std::string> findReachable(std::vector<std::unique_ptr<FunctionAST>> &Functions,
+                                           const std::set<std::string> &Exports)
+{
+  std::map<std::string, FunctionAST *> Definitions;
+  for (auto &FnAST : Functions)
+    Definitions[FnAST->getName()] = FnAST.get();
+
+  std::set<std::string> Reachable;
+  std::vector<std::string> Worklist(Exports.begin(), Exports.end());
+  while (!Worklist.empty())
+  {
+    auto Name = Worklist.back();
+    Worklist.pop_back();
+    auto Def = Definitions.find(Name);
+    if (Def == Definitions.end() || !Reachable.insert(Name).second)
+      continue;
+
+    std::set<std::string> Callees;
+    Def->second->collectCallees(Callees);
+    Worklist.insert(Worklist.end(), Callees.begin(), Callees.end());
+  }
+  return Reachable;
+}
+
+static void internalize(Function &F)
+{
+  F.setLinkage(Function::InternalLinkage);
+  F.setCallingConv(CallingConv::Fast);
+  for (auto *U : F.users())
+  {
+    auto *Call = dyn_cast<CallInst>(U);
+    if (!Call || Call->getCalledFunction() != &F)
+      continue;
+    Call->setCallingConv(CallingConv::Fast);
+  }
+}
+
+std::vector<Function *> codegenWholeProgram(std::vector<std::unique_ptr<FunctionAST>> &Functions,
+                                            const std::set<std::string> &Exports)
+{
+  for (auto &Name : Exports)
+  {
+    bool Defined = false;
+    for (auto &FnAST : Functions)
+      Defined |= FnAST->getName() == Name;
+    if (!Defined)
+      fprintf(stderr, "Warning: exported function '%s' is not defined\n", Name.c_str());
+  }
+
+  auto Reachable = findReachable(Functions, Exports);
+  std::vector<Function *> Lowered;
+  for (auto &FnAST : Functions)
+  {
+    if (!Reachable.count(FnAST->getName()))
+      continue;
+    if (auto *F = FnAST->codegen())
+      Lowered.push_back(F);
+  }
+
+  for (auto *F : Lowered)
+    if (!Exports.count(std::string(F->getName())))
+      internalize(*F);
+
+  /* musttail needs matching conventions on both ends. */
+  for (auto *F : Lowered)
+    for (auto &BB : *F)
+      for (auto &I : BB)
+        if (auto *Call = dyn_cast<CallInst>(&I))
+          if (Call->isMustTailCall() && Call->getCallingConv() != F->getCallingConv())
+            Call->setTailCallKind(CallInst::TCK_Tail);
+  return Lowered;
+}
@@ -0,0 +1,11 @@
+#ifndef WHOLEPROGRAM_H
+#define WHOLEPROGRAM_H
+#include "Codegen.h"
+#include <set>
+
+/* Lower only the definitions reachable from Exports, in source order.
+   Everything but the exports gets internal linkage and fastcc. */
+std::vector<Function *> codegenWholeProgram(std::vector<std::unique_ptr<FunctionAST>> &Functions,
+                                            const std::set<std::string> &Exports);
+
+#endif
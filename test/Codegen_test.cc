@@ -1,13 +1,36 @@
-#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
 #include "llvm/Support/TargetRegistry.h"
+#endif
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "../Backend.h"
+#include "../Cache.h"
 #include "../Codegen.h"
+#include "../FunctionAttrs.h"
+#include "../FunctionReport.h"
 #include "../Lex.h"
+#include "../MemReport.h"
+#include "../Optimize.h"
+#include "../Profile.h"
+#include "../TimeTrace.h"
+#include "../WholeProgram.h"
+// After Codegen.h, which has AST.h declare the codegen() members.
+#include "../ASTFile.h"
+#include <chrono>
 #include <memory>
 
 std::unique_ptr<LLVMContext> TheContext;
@@ -28,21 +51,89 @@ static void InitializeModuleAndPassManager()
 	Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
 	FPType = Builder->getDoubleTy();
-	FPPtrType = PointerType::get(FPType, 1 << 24);
+	FPPtrType = PointerType::get(FPType, 1);
 	IntType = Builder->getInt64Ty();
-	IntPtrType = PointerType::get(IntType, 1 << 24);
+	IntPtrType = PointerType::get(IntType, 1);
+}
+
+/* --whole-program: definitions are lowered after the whole input is read. */
+static bool WholeProgram = false;
+static std::set<std::string> Exports;
+static std::vector<std::unique_ptr<FunctionAST>> Definitions;
+
+/* --stream[=N]: MainLoop() returns after N definitions, so the batch can
+   be emitted and dropped before the next one is read. */
+static unsigned StreamBatch = 0;
+static unsigned NumDefinitions = 0;
+
+/* --emit-ast: the items are kept for the AST file instead of lowered. */
+static bool EmitAST = false;
+static std::vector<ASTItem> ASTItems;
+
+static double elapsedMs(std::chrono::steady_clock::time_point Start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+}
+
+// Start is when the parse of the definition began, for --func-report.
+static void AddDefinition(std::unique_ptr<FunctionAST> FnAST,
+						  std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now())
+{
+	std::string Name;
+	if (FunctionReport)
+	{
+		Name = FnAST->getName();
+		noteFunctionAST(*FnAST);
+	}
+	Function *FnIR = nullptr;
+	if (WholeProgram)
+		Definitions.push_back(std::move(FnAST));
+	else
+		FnIR = FnAST->codegen();
+	if (FunctionReport)
+		noteFunctionTime(Name, elapsedMs(Start));
+	if (FnIR)
+	{
+		fprintf(stderr, "Read function definition:");
+		FnIR->print(errs());
+		fprintf(stderr, "\n");
+		NumDefinitions++;
+	}
+}
+
+static void AddExtern(std::unique_ptr<PrototypeAST> ProtoAST)
+{
+	if (auto *FnIR = ProtoAST->codegen())
+	{
+		fprintf(stderr, "Read extern: ");
+		FnIR->print(errs());
+		fprintf(stderr, "\n");
+		FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+	}
+}
+
+static void AddStruct(std::unique_ptr<StructAST> StructAST)
+{
+	if (auto *Ty = StructAST->codegen())
+	{
+		fprintf(stderr, "Read struct: ");
+		Ty->print(errs());
+		fprintf(stderr, "\n");
+		StructDecls[StructAST->getType()] = std::move(StructAST);
+	}
 }
 
 static void HandleDefinition()
 {
+	auto Start = std::chrono::steady_clock::now();
 	if (auto FnAST = ParseFunctionDefinition())
 	{
-		if (auto *FnIR = FnAST->codegen())
-		{
-			fprintf(stderr, "Read function definition:");
-			FnIR->print(errs());
-			fprintf(stderr, "\n");
-		}
+		if (MemReport)
+			noteASTItem(*FnAST);
+		if (EmitAST)
+			ASTItems.push_back({nullptr, std::move(FnAST), nullptr});
+		else
+			AddDefinition(std::move(FnAST), Start);
 	}
 	else
 	{
@@ -55,13 +146,30 @@ static void HandleExtern()
 {
 	if (auto ProtoAST = ParseExternFunctionDeclaration())
 	{
-		if (auto *FnIR = ProtoAST->codegen())
-		{
-			fprintf(stderr, "Read extern: ");
-			FnIR->print(errs());
-			fprintf(stderr, "\n");
-			FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
-		}
+		if (MemReport)
+			noteASTItem(*ProtoAST);
+		if (EmitAST)
+			ASTItems.push_back({std::move(ProtoAST), nullptr, nullptr});
+		else
+			AddExtern(std::move(ProtoAST));
+	}
+	else
+	{
+		// Skip token for error recovery.
+		getNextToken();
+	}
+}
+
+static void HandleStruct()
+{
+	if (auto StructAST = ParseStructDeclaration())
+	{
+		if (MemReport)
+			noteASTItem(*StructAST);
+		if (EmitAST)
+			ASTItems.push_back({nullptr, nullptr, std::move(StructAST)});
+		else
+			AddStruct(std::move(StructAST));
 	}
 	else
 	{
@@ -70,11 +178,43 @@ static void HandleExtern()
 	}
 }
 
-/// top ::= definition | external | expression | ';'
+static void NoteASTItem(const ASTItem &Item)
+{
+	if (Item.Extern)
+		noteASTItem(*Item.Extern);
+	else if (Item.Function)
+		noteASTItem(*Item.Function);
+	else if (Item.Struct)
+		noteASTItem(*Item.Struct);
+}
+
+/* --import=file: lower the items of an AST file as if they were parsed. */
+static bool ImportASTFile(const std::string &ImportName)
+{
+	std::vector<ASTItem> Items;
+	if (!readASTFile(ImportName, Items))
+		return false;
+	for (auto &Item : Items)
+	{
+		if (MemReport)
+			NoteASTItem(Item);
+		if (Item.Extern)
+			AddExtern(std::move(Item.Extern));
+		else if (Item.Function)
+			AddDefinition(std::move(Item.Function));
+		else if (Item.Struct)
+			AddStruct(std::move(Item.Struct));
+	}
+	return true;
+}
+
+/// top ::= definition | external | struct | expression | ';'
 static void MainLoop()
 {
 	while (true)
 	{
+		if (StreamBatch && NumDefinitions >= StreamBatch)
+			return;
 		switch (CurTok)
 		{
 		case tok_eof:
@@ -85,6 +225,9 @@ static void MainLoop()
 		case tok_extern:
 			HandleExtern();
 			break;
+		case tok_struct:
+			HandleStruct();
+			break;
 		default:
 			std::cout << "invalid input" << std::endl;
 			getNextToken();
@@ -99,23 +242,226 @@ static void MainLoop()
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
+	char *FileName = nullptr;
+	std::string OutputName;
+	std::vector<std::string> Imports;
+	unsigned OptLevel = 0;
+	LTOKind LTO = lto_none;
+	FastMathFlags FMF;
+	std::string CPU = "generic", Features;
+	bool TimeTrace = false;
+	std::string TimeTraceFile;
+	std::string MemReportFile;
+	for (int i = 1; i < argc; i++)
+	{
+		StringRef Arg = argv[i];
+		if (Arg.size() == 3 && Arg.startswith("-O") && Arg[2] >= '0' && Arg[2] <= '3')
+			OptLevel = Arg[2] - '0';
+		else if (Arg == "-o" && i + 1 < argc)
+			OutputName = argv[++i];
+		else if (Arg == "-flto" || Arg == "-flto=full")
+			LTO = lto_full;
+		else if (Arg == "-flto=thin")
+			LTO = lto_thin;
+		else if (Arg == "-fprofile-generate")
+			ProfileGenerate = true;
+		else if (Arg.consume_front("-fprofile-generate="))
+		{
+			ProfileGenerate = true;
+			ProfileGenerateFile = Arg.str();
+		}
+		else if (Arg.consume_front("-fprofile-use="))
+		{
+			if (!loadProfile(Arg.str()))
+			{
+				errs() << "The profile '" << Arg << "' is not existed";
+				return 1;
+			}
+		}
+		else if (Arg == "-fnumeric")
+			NumericMode = true;
+		else if (Arg == "-ffast-math")
+			FMF.setFast();
+		else if (Arg.consume_front("-ffast-math="))
+		{
+			SmallVector<StringRef, 8> Flags;
+			Arg.split(Flags, ',', -1, false);
+			for (auto Flag : Flags)
+			{
+				if (Flag == "reassoc")
+					FMF.setAllowReassoc();
+				else if (Flag == "nnan")
+					FMF.setNoNaNs();
+				else if (Flag == "ninf")
+					FMF.setNoInfs();
+				else if (Flag == "nsz")
+					FMF.setNoSignedZeros();
+				else if (Flag == "arcp")
+					FMF.setAllowReciprocal();
+				else if (Flag == "contract")
+					FMF.setAllowContract();
+				else if (Flag == "afn")
+					FMF.setApproxFunc();
+				else
+				{
+					errs() << "Unknown fast-math flag '" << Flag << "'";
+					return 1;
+				}
+			}
+		}
+		else if (Arg.consume_front("-fveclib="))
+		{
+			int Lib = StringSwitch<int>(Arg)
+										.Case("none", TargetLibraryInfoImpl::NoLibrary)
+										.Case("libmvec", TargetLibraryInfoImpl::LIBMVEC_X86)
+										.Case("SVML", TargetLibraryInfoImpl::SVML)
+										.Case("MASSV", TargetLibraryInfoImpl::MASSV)
+										.Case("Accelerate", TargetLibraryInfoImpl::Accelerate)
+										.Default(-1);
+			if (Lib < 0)
+			{
+				errs() << "Unknown vector library '" << Arg << "'";
+				return 1;
+			}
+			VecLib = (TargetLibraryInfoImpl::VectorLibrary)Lib;
+		}
+		else if (Arg.consume_front("-mcpu="))
+			CPU = Arg == "native" ? sys::getHostCPUName().str() : Arg.str();
+		else if (Arg.consume_front("-mattr="))
+			Features = Arg.str();
+		else if (Arg == "-j" && i + 1 < argc)
+			BackendJobs = atoi(argv[++i]);
+		else if (Arg.consume_front("--opt-jobs="))
+			OptimizeJobs = atoi(Arg.str().c_str());
+		else if (Arg == "-fno-tail-loop")
+			TailRecursionToLoop = false;
+		else if (Arg.consume_front("--whole-program="))
+		{
+			SmallVector<StringRef, 8> Names;
+			Arg.split(Names, ',', -1, false);
+			for (auto Name : Names)
+				Exports.insert(Name.str());
+			WholeProgram = true;
+		}
+		else if (Arg.consume_front("--cache="))
+			CacheDir = Arg.str();
+		else if (Arg.consume_front("--cache-size="))
+			CacheSize = atoi(Arg.str().c_str());
+		else if (Arg == "--stream")
+			StreamBatch = 1000;
+		else if (Arg.consume_front("--stream="))
+			StreamBatch = std::max(atoi(Arg.str().c_str()), 1);
+		else if (Arg == "--emit-ast")
+			EmitAST = true;
+		else if (Arg.consume_front("--import="))
+			Imports.push_back(Arg.str());
+		else if (Arg == "--time-trace")
+			TimeTrace = true;
+		else if (Arg.consume_front("--time-trace="))
+		{
+			TimeTrace = true;
+			TimeTraceFile = Arg.str();
+		}
+		else if (Arg.consume_front("--time-trace-granularity="))
+			TimeTraceGranularity = atoi(Arg.str().c_str());
+		else if (Arg == "--mem-report")
+			MemReport = true;
+		else if (Arg.consume_front("--mem-report="))
+		{
+			MemReport = true;
+			MemReportFile = Arg.str();
+		}
+		else if (Arg == "--func-report")
+			FunctionReport = true;
+		else if (Arg.startswith("-"))
+		{
+			errs() << "Unknown option '" << Arg << "'";
+			return 1;
+		}
+		else
+			FileName = argv[i];
+	}
+
+	if (!FileName && Imports.empty())
 	{
 		errs() << "You need to specify the file to compile";
 		return 1;
 	}
-	char *FileName = argv[1];
-	fip = fopen(FileName, "r");
-	if (fip == nullptr)
+	if (FileName && !(fip = fopen(FileName, "r")))
 	{
 		errs() << "The file '" << FileName << "' is not existed";
 		return 1;
 	}
+	std::string SourceName = FileName ? FileName : Imports.front();
 
-	getNextToken();
+	if (StreamBatch && (LTO || WholeProgram))
+	{
+		errs() << "--stream can't be combined with -flto or --whole-program";
+		return 1;
+	}
+	if (!CacheDir.empty() && (LTO || WholeProgram || ProfileGenerate))
+	{
+		errs() << "--cache can't be combined with -flto, --whole-program or -fprofile-generate";
+		return 1;
+	}
 
-	InitializeModuleAndPassManager();
-	MainLoop();
+	if (EmitAST && (!FileName || !Imports.empty()))
+	{
+		errs() << "--emit-ast needs a file to parse and can't be combined with --import";
+		return 1;
+	}
+
+	// Written on every way out, the output name is only final by then.
+	if (TimeTrace)
+		timeTraceProfilerInitialize(TimeTraceGranularity, "bobo");
+	auto WriteTimeTrace = [&]
+	{
+		if (!TimeTrace)
+			return;
+		if (TimeTraceFile.empty())
+		{
+			SmallString<128> Path(OutputName.empty() ? "output" : OutputName);
+			sys::path::replace_extension(Path, "json");
+			TimeTraceFile = Path.str().str();
+		}
+		if (auto Err = timeTraceProfilerWrite(TimeTraceFile, ""))
+			errs() << "Could not write the time trace: " << toString(std::move(Err)) << "\n";
+		timeTraceProfilerCleanup();
+	};
+	auto TimeTraceOnExit = make_scope_exit(WriteTimeTrace);
+	if (MemReport)
+		noteMemPhase("start");
+	auto WriteMemReport = [&]
+	{
+		if (!MemReport)
+			return;
+		if (MemReportFile.empty())
+		{
+			SmallString<128> Path(OutputName.empty() ? "output" : OutputName);
+			sys::path::replace_extension(Path, "mem.json");
+			MemReportFile = Path.str().str();
+		}
+		writeMemReport(MemReportFile);
+	};
+	auto MemReportOnExit = make_scope_exit(WriteMemReport);
+
+	if (FileName)
+		getNextToken();
+	else
+		CurTok = tok_eof;
+
+	if (EmitAST)
+	{
+		MainLoop();
+		if (MemReport)
+			noteMemPhase("parse");
+		if (OutputName.empty())
+			OutputName = "output.boboast";
+		if (!writeASTFile(ASTItems, OutputName))
+			return 1;
+		outs() << "Wrote " << OutputName << "\n";
+		return 0;
+	}
 
 	InitializeAllTargetInfos();
 	InitializeAllTargets();
@@ -124,7 +470,6 @@ int main(int argc, char *argv[])
 	InitializeAllAsmPrinters();
 
 	auto TargetTriple = sys::getDefaultTargetTriple();
-	TheModule->setTargetTriple(TargetTriple);
 
 	std::string Error;
 	auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
@@ -138,36 +483,148 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	auto CPU = "generic";
-	auto Features = "";
-
 	TargetOptions opt;
+	opt.EnableMachineFunctionSplitter = hasProfileUse();
 	auto RM = Optional<Reloc::Model>();
-	auto TheTargetMachine =
-			Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
-	TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+	auto CreateTargetMachine = [&]
+	{
+		return std::unique_ptr<TargetMachine>(Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM));
+	};
+	auto TheTargetMachine = CreateTargetMachine();
 
-	auto Filename = "output.o";
-	std::error_code EC;
-	raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+	// Every batch of --stream gets a context of its own, so the memory of
+	// the previous one is really released.
+	auto StartModule = [&]
+	{
+		Builder.reset();
+		TheModule.reset();
+		InitializeModuleAndPassManager();
+		Builder->setFastMathFlags(FMF);
+		/* ThinLTO derives the GUIDs of internal functions from this name. */
+		TheModule->setSourceFileName(SourceName);
+		TheModule->setTargetTriple(TargetTriple);
+		// Set before codegen, loads and stores take their alignment from it.
+		TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+	};
+	auto FinishModule = [&]
+	{
+		if (MemReport)
+			noteMemPhase("codegen", TheModule.get());
+		profileFinishModule(*TheModule);
+		inferFunctionAttrs(*TheModule);
 
-	if (EC)
+		{
+			TimeTraceScope Scope("VerifyModule");
+			if (verifyModule(*TheModule, &errs()))
+			{
+				errs() << "Generated module is broken";
+				return false;
+			}
+		}
+		if (FunctionReport)
+			noteFunctionIR(*TheModule, false);
+		// --cache optimizes each function when it is not in the cache.
+		if (CacheDir.empty() && !optimizeModule(*TheModule, TheTargetMachine.get(), OptLevel, LTO))
+			return false;
+		if (MemReport && CacheDir.empty())
+			noteMemPhase("optimize", TheModule.get());
+		if (FunctionReport && CacheDir.empty())
+			noteFunctionIR(*TheModule, true);
+		return true;
+	};
+	auto EmitObject = [&](const std::string &Output)
 	{
-		errs() << "Could not open file: " << EC.message();
-		return 1;
-	}
+		bool Ok = !CacheDir.empty()
+					  ? emitCachedObjectFile(*TheModule, CreateTargetMachine, OptLevel, Output)
+					  : emitObjectFile(*TheModule, CreateTargetMachine, Output);
+		if (MemReport)
+			noteMemPhase("backend");
+		return Ok;
+	};
 
-	legacy::PassManager pass;
-	auto FileType = CGFT_ObjectFile;
+	if (OutputName.empty())
+		OutputName = LTO ? "output.bc" : "output.o";
+	auto Filename = OutputName.c_str();
 
-	if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType))
+	// Functions already emitted stay declared through FunctionProtos.
+	std::vector<std::string> Batches;
+	auto BatchName = [&]
+	{
+		StringRef Stem = OutputName;
+		Stem.consume_back(".o");
+		return (Stem + ".batch" + Twine(Batches.size() + 1) + ".o").str();
+	};
+	StartModule();
+	for (auto &ImportName : Imports)
+		if (!ImportASTFile(ImportName))
+			return 1;
+	MainLoop();
+	while (StreamBatch && CurTok != tok_eof)
 	{
-		errs() << "TheTargetMachine can't emit a file of this type";
+		Batches.push_back(BatchName());
+		if (!FinishModule() || !EmitObject(Batches.back()))
+			return 1;
+		StartModule();
+		NumDefinitions = 0;
+		MainLoop();
+	}
+	if (WholeProgram)
+	{
+		for (auto *FnIR : codegenWholeProgram(Definitions, Exports))
+		{
+			fprintf(stderr, "Read function definition:");
+			FnIR->print(errs());
+			fprintf(stderr, "\n");
+		}
+	}
+	if (!FinishModule())
 		return 1;
+
+	// Bitcode for the LTO link step, see test/Link_test.cc. ThinLTO
+	// needs the module summary to decide on cross-module imports.
+	if (LTO)
+	{
+		std::error_code EC;
+		raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+		if (EC)
+		{
+			errs() << "Could not open file: " << EC.message();
+			return 1;
+		}
+
+		if (LTO == lto_thin)
+		{
+			ProfileSummaryInfo PSI(*TheModule);
+			auto Index = buildModuleSummaryIndex(*TheModule, nullptr, &PSI);
+			WriteBitcodeToFile(*TheModule, dest, false, &Index);
+		}
+		else
+			WriteBitcodeToFile(*TheModule, dest);
+		dest.flush();
+		if (MemReport)
+			noteMemPhase("bitcode");
+		if (FunctionReport)
+			writeFunctionReport(OutputName);
+		outs() << "Wrote " << Filename << "\n";
+		return 0;
 	}
 
-	pass.run(*TheModule);
-	dest.flush();
+	if (!Batches.empty())
+	{
+		Batches.push_back(BatchName());
+		bool Merged = EmitObject(Batches.back()) &&
+							  mergeObjects(Batches, OutputName);
+		for (auto &Batch : Batches)
+			sys::fs::remove(Batch);
+		if (!Merged)
+			return 1;
+	}
+	else if (!EmitObject(OutputName))
+		return 1;
+
+	// Machine code sizes come from the symbols of the final object.
+	if (FunctionReport && noteFunctionCode(OutputName))
+		writeFunctionReport(OutputName);
 
 	outs() << "Wrote " << Filename << "\n";
 
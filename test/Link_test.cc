@@ -0,0 +1,161 @@
+#include "llvm/Config/llvm-config.h"
+#include "llvm/LTO/LTO.h"
+#include "llvm/Support/Caching.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// LTO link step: takes the bitcode written by Codegen_test.o -flto[=thin].
+// Modules with a summary go through ThinLTO (cross-module import, one
+// backend job per module in parallel), the others are merged for full LTO.
+//===----------------------------------------------------------------------===//
+
+static std::string taskOutputName(StringRef Output, unsigned Task)
+{
+	if (Task == 0)
+		return Output.str();
+	StringRef Stem = Output;
+	Stem.consume_back(".o");
+	return (Stem + "." + Twine(Task) + ".o").str();
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<std::string> Inputs;
+	std::set<std::string> Exports;
+	std::string Output = "output.o";
+	unsigned OptLevel = 2;
+	unsigned Jobs = 0;
+	std::string CPU = "generic";
+	std::vector<std::string> Features;
+	for (int i = 1; i < argc; i++)
+	{
+		StringRef Arg = argv[i];
+		if (Arg.size() == 3 && Arg.startswith("-O") && Arg[2] >= '0' && Arg[2] <= '3')
+			OptLevel = Arg[2] - '0';
+		else if (Arg == "-o" && i + 1 < argc)
+			Output = argv[++i];
+		else if (Arg.consume_front("-mcpu="))
+			CPU = Arg == "native" ? sys::getHostCPUName().str() : Arg.str();
+		else if (Arg.consume_front("-mattr="))
+		{
+			SmallVector<StringRef, 8> Attrs;
+			Arg.split(Attrs, ',', -1, false);
+			for (auto Attr : Attrs)
+				Features.push_back(Attr.str());
+		}
+		else if (Arg == "-j" && i + 1 < argc)
+			Jobs = atoi(argv[++i]);
+		else if (Arg.consume_front("--export="))
+		{
+			SmallVector<StringRef, 8> Names;
+			Arg.split(Names, ',', -1, false);
+			for (auto Name : Names)
+				Exports.insert(Name.str());
+		}
+		else if (Arg.startswith("-"))
+		{
+			errs() << "Unknown option '" << Arg << "'";
+			return 1;
+		}
+		else
+			Inputs.push_back(Arg.str());
+	}
+
+	if (Inputs.empty())
+	{
+		errs() << "You need to specify the bitcode files to link";
+		return 1;
+	}
+
+	InitializeAllTargetInfos();
+	InitializeAllTargets();
+	InitializeAllTargetMCs();
+	InitializeAllAsmParsers();
+	InitializeAllAsmPrinters();
+
+	lto::Config Conf;
+	Conf.CPU = CPU;
+	Conf.MAttrs = Features;
+	Conf.DefaultTriple = sys::getDefaultTargetTriple();
+	Conf.OptLevel = OptLevel;
+	Conf.CGOptLevel = OptLevel ? CodeGenOpt::Default : CodeGenOpt::None;
+
+	auto Backend = lto::createInProcessThinBackend(heavyweight_hardware_concurrency(Jobs));
+	lto::LTO Linker(std::move(Conf), Backend);
+
+	// Buffers must stay alive until the link has run.
+	std::vector<std::unique_ptr<MemoryBuffer>> Buffers;
+	std::set<std::string> Defined;
+	for (auto &Input : Inputs)
+	{
+		auto BufferOrErr = MemoryBuffer::getFile(Input);
+		if (!BufferOrErr)
+		{
+			errs() << "The file '" << Input << "' is not existed";
+			return 1;
+		}
+		Buffers.push_back(std::move(*BufferOrErr));
+
+		auto FileOrErr = lto::InputFile::create(Buffers.back()->getMemBufferRef());
+		if (!FileOrErr)
+		{
+			errs() << Input << ": " << toString(FileOrErr.takeError());
+			return 1;
+		}
+
+		// The first definition of a symbol wins. Without --export every
+		// definition stays visible, otherwise the rest may be internalized.
+		std::vector<lto::SymbolResolution> Resolutions;
+		for (auto &Sym : (*FileOrErr)->symbols())
+		{
+			lto::SymbolResolution Res;
+			if (!Sym.isUndefined())
+			{
+				Res.Prevailing = Defined.insert(Sym.getName().str()).second;
+				Res.FinalDefinitionInLinkageUnit = true;
+				Res.VisibleToRegularObj = Exports.empty() || Exports.count(Sym.getName().str());
+			}
+			Resolutions.push_back(Res);
+		}
+
+		if (auto Err = Linker.add(std::move(*FileOrErr), Resolutions))
+		{
+			errs() << Input << ": " << toString(std::move(Err));
+			return 1;
+		}
+	}
+
+	std::vector<std::string> Written(Linker.getMaxTasks());
+	auto AddStream = [&](unsigned Task) -> Expected<std::unique_ptr<CachedFileStream>>
+	{
+		Written[Task] = taskOutputName(Output, Task);
+		std::error_code EC;
+		auto OS = std::make_unique<raw_fd_ostream>(Written[Task], EC, sys::fs::OF_None);
+		if (EC)
+			return errorCodeToError(EC);
+		return std::make_unique<CachedFileStream>(std::move(OS), Written[Task]);
+	};
+
+	if (auto Err = Linker.run(AddStream))
+	{
+		errs() << toString(std::move(Err));
+		return 1;
+	}
+
+	for (auto &Filename : Written)
+		if (!Filename.empty())
+			outs() << "Wrote " << Filename << "\n";
+
+	return 0;
+}
@@ -32,6 +32,20 @@ void HandleExtern()
   }
 }
 
+void HandleStruct()
+{
+  if (auto StructAST = ParseStructDeclaration())
+  {
+    std::cout << "Parsed a struct" << std::endl;
+    StructAST->output();
+  }
+  else
+  {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
 void MainLoop()
 {
   while (true)
@@ -46,6 +60,9 @@ void MainLoop()
     case tok_extern:
       HandleExtern();
       break;
+    case tok_struct:
+      HandleStruct();
+      break;
     default:
       std::cout << "invalid input" << std::endl;
       getNextToken();
@@ -0,0 +1,74 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "../Reparse.h"
+
+//===----------------------------------------------------------------------===//
+// Applies a fixed series of edits to the source in the input file and
+// prints, after each, the items with their spans, the items parsed again
+// and the functions the edit removed. Edits find their place by text, so
+// the input may change as long as it keeps the strings they look for.
+//===----------------------------------------------------------------------===//
+
+static std::string describe(const IncrementalParser::Item &I)
+{
+	if (I.AST.Function)
+		return "function " + I.AST.Function->getName();
+	if (I.AST.Extern)
+		return "extern " + I.AST.Extern->getName();
+	if (I.AST.Struct)
+		return "struct " + I.AST.Struct->getName();
+	return "error";
+}
+
+static void print(const IncrementalParser &Parser)
+{
+	for (auto &I : Parser.getItems())
+		std::cout << "[" << I.Begin << ", " << I.End << ") " << describe(I) << std::endl;
+}
+
+static void edit(IncrementalParser &Parser, const std::string &Title, size_t Offset, size_t Length,
+				 const std::string &Text)
+{
+	std::cout << Title << std::endl;
+	auto Changed = Parser.edit(Offset, Length, Text);
+	print(Parser);
+	std::cout << "Changed:";
+	for (auto I : Changed)
+		std::cout << " " << describe(*I);
+	std::cout << std::endl << "Removed:";
+	for (auto &Name : Parser.getRemoved())
+		std::cout << " " << Name;
+	std::cout << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		std::cout << "You need to specify the file to compile" << std::endl;
+		return 1;
+	}
+	std::ifstream In(argv[1]);
+	if (!In)
+	{
+		std::cout << "The file '" << argv[1] << "' is not existed" << std::endl;
+		return 1;
+	}
+	std::stringstream Source;
+	Source << In.rdbuf();
+
+	IncrementalParser Parser(Source.str());
+	std::cout << "Initial" << std::endl;
+	print(Parser);
+
+	auto At = [&](const std::string &Text)
+	{ return Parser.getSource().find(Text); };
+	edit(Parser, "Edit inside a body", At("b + 1"), 5, "b + 10");
+	edit(Parser, "Delete a function", At("int twice"), At("int dec") - At("int twice"), "");
+	edit(Parser, "Rename a function", At("dec("), 3, "decrement");
+	edit(Parser, "Prepend an extern", 0, 0, "extern double sqrt(double x);\n\n");
+	edit(Parser, "Append a function", Parser.getSource().size(), 0, "\nint last(){\n\treturn 0;\n}\n");
+	edit(Parser, "Break a body", At("a - 1;"), 6, "a -;");
+	return 0;
+}
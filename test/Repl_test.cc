@@ -0,0 +1,396 @@
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/TargetSelect.h"
+#include "../Cache.h"
+#include "../Codegen.h"
+#include "../FunctionAttrs.h"
+#include "../Lex.h"
+#include "../Optimize.h"
+#include <chrono>
+#include <map>
+#include <memory>
+
+using namespace llvm::orc;
+
+//===----------------------------------------------------------------------===//
+// Interactive driver: every definition is lowered into a module of its own
+// and compiled by the JIT as <name>.v<N>. Other code calls <name> through an
+// indirection stub, redefining the function compiles the new version and
+// swaps the stub's pointer, so everything calling it, even code running
+// right now, takes the new body on its next call. Old versions are never
+// freed. A top-level expression `f(3);` is compiled and run at once.
+//===----------------------------------------------------------------------===//
+
+std::unique_ptr<LLVMContext> TheContext;
+std::unique_ptr<Module> TheModule;
+std::unique_ptr<IRBuilder<>> Builder;
+Type *FPType;
+IntegerType *IntType;
+PointerType *FPPtrType;
+PointerType *IntPtrType;
+
+extern "C" int64_t __bobo_parallel_chunks(int64_t Begin, int64_t End, int64_t Grain);
+extern "C" void __bobo_parallel_for(void (*Body)(void **, int64_t, int64_t, int64_t), void **Ctx,
+									int64_t Begin, int64_t End, int64_t Grain);
+
+static std::unique_ptr<LLJIT> TheJIT;
+static std::unique_ptr<IndirectStubsManager> Stubs;
+static std::unique_ptr<TargetMachine> TheTargetMachine;
+static unsigned OptLevel = 0;
+
+/* A function defined in the REPL. Callers bind to Stub, a new stub is only
+   made when the prototype changes, as callers compiled against the old
+   one would pass the wrong arguments. */
+struct ReplFunction
+{
+	std::string Stub;
+	unsigned Version = 0, Signature = 0;
+	/* Stubs the current version calls. */
+	std::set<std::string> Calls;
+};
+static std::map<std::string, ReplFunction> ReplFunctions;
+
+static void InitializeModuleAndPassManager()
+{
+	// Open a new context and module, the old module goes first.
+	Builder.reset();
+	TheModule.reset();
+	TheContext = std::make_unique<LLVMContext>();
+	TheModule = std::make_unique<Module>("repl", *TheContext);
+	TheModule->setDataLayout(TheJIT->getDataLayout());
+	TheModule->setTargetTriple(TheJIT->getTargetTriple().str());
+
+	// Create a new builder for the module.
+	Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+	FPType = Builder->getDoubleTy();
+	FPPtrType = PointerType::get(FPType, 1);
+	IntType = Builder->getInt64Ty();
+	IntPtrType = PointerType::get(IntType, 1);
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point Start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+}
+
+/* Calls go to the stub of the callee's current prototype. */
+static void bindCallsToStubs(Module &M, std::set<std::string> &Calls)
+{
+	for (auto &F : M)
+	{
+		auto RF = ReplFunctions.find(std::string(F.getName()));
+		if (!F.isDeclaration() || RF == ReplFunctions.end())
+			continue;
+		Calls.insert(RF->second.Stub);
+		if (F.getName() != RF->second.Stub)
+			F.setName(RF->second.Stub);
+	}
+}
+
+/* Optimize the module, hand it to the JIT and compile Name right away. */
+static Expected<JITTargetAddress> compileModule(const std::string &Name, ResourceTrackerSP RT = nullptr)
+{
+	inferFunctionAttrs(*TheModule);
+	if (verifyModule(*TheModule, &errs()))
+		return make_error<StringError>("Generated module is broken", inconvertibleErrorCode());
+	if (!optimizeModule(*TheModule, TheTargetMachine.get(), OptLevel))
+		return make_error<StringError>("Optimized module is broken", inconvertibleErrorCode());
+
+	Builder.reset();
+	ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+	auto Err = RT ? TheJIT->addIRModule(RT, std::move(TSM)) : TheJIT->addIRModule(std::move(TSM));
+	if (Err)
+		return Expected<JITTargetAddress>(std::move(Err));
+	auto Sym = TheJIT->lookup(Name);
+	if (!Sym)
+		return Sym.takeError();
+	return Sym->getAddress();
+}
+
+static void AddDefinition(std::unique_ptr<FunctionAST> FnAST)
+{
+	auto Start = std::chrono::steady_clock::now();
+	auto Name = FnAST->getName();
+	auto OldProto = FunctionProtos.count(Name) ? std::move(FunctionProtos[Name]) : nullptr;
+	auto *FnIR = FnAST->codegen();
+	if (!FnIR)
+	{
+		if (OldProto)
+			FunctionProtos[Name] = std::move(OldProto);
+		else
+			FunctionProtos.erase(Name);
+		return;
+	}
+
+	auto &RF = ReplFunctions[Name];
+	auto &Proto = *FunctionProtos[Name];
+	bool NewStub = RF.Stub.empty();
+	if (OldProto && !NewStub &&
+		(OldProto->getArgTypes() != Proto.getArgTypes() || OldProto->getReturnType() != Proto.getReturnType()))
+	{
+		NewStub = true;
+		std::string Callers;
+		for (auto &Other : ReplFunctions)
+			if (Other.first != Name && Other.second.Calls.count(RF.Stub))
+				Callers += " " + Other.first;
+		if (!Callers.empty())
+			fprintf(stderr, "Warning: prototype of '%s' changed, still calling the old version:%s\n",
+					Name.c_str(), Callers.c_str());
+		RF.Signature++;
+	}
+	if (NewStub)
+		RF.Stub = RF.Signature ? Name + ".s" + std::to_string(RF.Signature) : Name;
+
+	auto Version = Name + ".v" + std::to_string(++RF.Version);
+	FnIR->setName(Version);
+	RF.Calls.clear();
+	bindCallsToStubs(*TheModule, RF.Calls);
+
+	auto Addr = compileModule(Version);
+	if (!Addr)
+	{
+		logAllUnhandledErrors(Addr.takeError(), errs(), "Error: ");
+		return;
+	}
+	auto Compiled = elapsedMs(Start);
+
+	/* The new stub is defined in the JIT before anything can call it. */
+	auto SwapStart = std::chrono::steady_clock::now();
+	if (NewStub)
+	{
+		if (auto Err = Stubs->createStub(RF.Stub, *Addr, JITSymbolFlags::Exported))
+		{
+			logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+			return;
+		}
+		auto Stub = Stubs->findStub(RF.Stub, true);
+		if (auto Err = TheJIT->getMainJITDylib().define(absoluteSymbols({{TheJIT->mangleAndIntern(RF.Stub), Stub}})))
+		{
+			logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+			return;
+		}
+	}
+	else if (auto Err = Stubs->updatePointer(RF.Stub, *Addr))
+	{
+		logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+		return;
+	}
+	fprintf(stderr, "%s %s: recompile %.3f ms, swap %.3f ms\n", NewStub ? "Defined" : "Swapped",
+			Version.c_str(), Compiled, elapsedMs(SwapStart));
+}
+
+static void AddExtern(std::unique_ptr<PrototypeAST> ProtoAST)
+{
+	if (ProtoAST->codegen())
+	{
+		fprintf(stderr, "Read extern: %s\n", ProtoAST->getName().c_str());
+		FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+	}
+	InitializeModuleAndPassManager();
+}
+
+static void AddStruct(std::unique_ptr<StructAST> StructAST)
+{
+	if (StructAST->codegen())
+	{
+		fprintf(stderr, "Read struct: %s\n", StructAST->getName().c_str());
+		StructDecls[StructAST->getType()] = std::move(StructAST);
+	}
+	InitializeModuleAndPassManager();
+}
+
+/* Wrap the expression into a function returning double, run and drop it. */
+static void HandleTopLevelExpression()
+{
+	auto E = ParseExpression();
+	if (!E)
+	{
+		// Skip token for error recovery.
+		getNextToken();
+		return;
+	}
+
+	static const std::string Name = "__bobo_repl_expr";
+	std::vector<std::unique_ptr<StmtAST>> Stmts;
+	Stmts.push_back(std::make_unique<ReturnStmtAST>(std::move(E)));
+	auto FnAST = std::make_unique<FunctionAST>(std::make_unique<PrototypeAST>(Name, std::vector<std::string>(), std::vector<int>(), type_double),
+											   std::make_unique<BlockAST>(std::move(Stmts)));
+	auto FnIR = FnAST->codegen();
+	FunctionProtos.erase(Name);
+	if (FnIR)
+	{
+		std::set<std::string> Calls;
+		bindCallsToStubs(*TheModule, Calls);
+		auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+		auto Addr = compileModule(Name, RT);
+		if (Addr)
+		{
+			auto Start = std::chrono::steady_clock::now();
+			auto Result = jitTargetAddressToFunction<double (*)()>(*Addr)();
+			fprintf(stderr, "%g (%.3f ms)\n", Result, elapsedMs(Start));
+		}
+		else
+			logAllUnhandledErrors(Addr.takeError(), errs(), "Error: ");
+		cantFail(RT->remove());
+	}
+	InitializeModuleAndPassManager();
+
+	// Run before reading on, the next token may not be typed yet.
+	if (CurTok == ';')
+		getNextToken();
+}
+
+static void HandleDefinition()
+{
+	if (auto FnAST = ParseFunctionDefinition())
+		AddDefinition(std::move(FnAST));
+	else
+	{
+		// Skip token for error recovery.
+		getNextToken();
+	}
+	InitializeModuleAndPassManager();
+}
+
+static void HandleExtern()
+{
+	if (auto ProtoAST = ParseExternFunctionDeclaration())
+		AddExtern(std::move(ProtoAST));
+	else
+	{
+		// Skip token for error recovery.
+		getNextToken();
+	}
+}
+
+static void HandleStruct()
+{
+	if (auto StructAST = ParseStructDeclaration())
+		AddStruct(std::move(StructAST));
+	else
+	{
+		// Skip token for error recovery.
+		getNextToken();
+	}
+}
+
+/// top ::= definition | external | struct | expression ';' | ';'
+static void MainLoop(bool Interactive)
+{
+	while (true)
+	{
+		switch (CurTok)
+		{
+		case tok_eof:
+			return;
+		case tok_def:
+			HandleDefinition();
+			break;
+		case tok_extern:
+			HandleExtern();
+			break;
+		case tok_struct:
+			HandleStruct();
+			break;
+		case ';':
+			getNextToken();
+			break;
+		default:
+			HandleTopLevelExpression();
+			break;
+		}
+		if (Interactive)
+			fprintf(stderr, "ready> ");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char *FileName = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		StringRef Arg = argv[i];
+		if (Arg.size() == 3 && Arg.startswith("-O") && Arg[2] >= '0' && Arg[2] <= '3')
+			OptLevel = Arg[2] - '0';
+		else if (Arg.consume_front("--cache="))
+			CacheDir = Arg.str();
+		else if (Arg.consume_front("--cache-size="))
+			CacheSize = atoi(Arg.str().c_str());
+		else if (Arg.startswith("-"))
+		{
+			errs() << "Unknown option '" << Arg << "'";
+			return 1;
+		}
+		else
+			FileName = argv[i];
+	}
+
+	fip = FileName ? fopen(FileName, "r") : stdin;
+	if (fip == nullptr)
+	{
+		errs() << "The file '" << FileName << "' is not existed";
+		return 1;
+	}
+
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+
+	auto JTMB = JITTargetMachineBuilder::detectHost();
+	if (!JTMB)
+	{
+		logAllUnhandledErrors(JTMB.takeError(), errs(), "Error: ");
+		return 1;
+	}
+	auto TM = JTMB->createTargetMachine();
+	if (!TM)
+	{
+		logAllUnhandledErrors(TM.takeError(), errs(), "Error: ");
+		return 1;
+	}
+	TheTargetMachine = std::move(*TM);
+
+	// --cache keeps the objects of whole modules, see ObjectFileCache.
+	std::unique_ptr<ObjectFileCache> ObjCache;
+	if (!CacheDir.empty())
+		ObjCache = std::make_unique<ObjectFileCache>(getCacheOptions(*TheTargetMachine, OptLevel));
+
+	auto JIT = LLJITBuilder()
+				   .setJITTargetMachineBuilder(*JTMB)
+				   .setCompileFunctionCreator([&](JITTargetMachineBuilder JTMB)
+											  -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>>
+											  {
+												  auto TM = JTMB.createTargetMachine();
+												  if (!TM)
+													  return TM.takeError();
+												  return std::make_unique<TMOwningSimpleCompiler>(std::move(*TM), ObjCache.get());
+											  })
+				   .create();
+	if (!JIT)
+	{
+		logAllUnhandledErrors(JIT.takeError(), errs(), "Error: ");
+		return 1;
+	}
+	TheJIT = std::move(*JIT);
+	Stubs = createLocalIndirectStubsManagerBuilder(TheJIT->getTargetTriple())();
+
+	// Externs resolve to the process, the parallel runtime is linked in.
+	auto &JD = TheJIT->getMainJITDylib();
+	JD.addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(TheJIT->getDataLayout().getGlobalPrefix())));
+	cantFail(JD.define(absoluteSymbols(
+		{{TheJIT->mangleAndIntern("__bobo_parallel_chunks"), JITEvaluatedSymbol::fromPointer(__bobo_parallel_chunks)},
+		 {TheJIT->mangleAndIntern("__bobo_parallel_for"), JITEvaluatedSymbol::fromPointer(__bobo_parallel_for)}})));
+
+	InitializeModuleAndPassManager();
+	bool Interactive = !FileName;
+	if (Interactive)
+		fprintf(stderr, "ready> ");
+	getNextToken();
+	MainLoop(Interactive);
+
+	return 0;
+}